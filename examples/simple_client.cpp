@@ -22,7 +22,21 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	// RDT_TRACE=path records every packet sent and received, for
+	// tools/rdt_trace_decode
+	const char *pTracePath = getenv("RDT_TRACE");
+	if(pTracePath && RdtTrace::Open(pTracePath, RTL_PACKET) == -1)
+	{
+		cout << "Couldn't create trace file " << pTracePath << "\n";
+	}
+
+	// RDT_IO_URING=1 moves the socket and file I/O onto io_uring
 	RdtConnection server;
+	if(getenv("RDT_IO_URING"))
+	{
+		server.SetIoBackend(EIB_URING);
+	}
+
 	if(server.Initialize())
 	{
 		ERROR(ERR_SOCKET, true);
@@ -61,6 +75,7 @@ int main(int argc, char **argv)
 		ERROR(ERR_CLOSE, false);
 	}
 
+	RdtTrace::Close();
 	return 0;
 }
 
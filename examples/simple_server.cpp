@@ -1,17 +1,19 @@
 /* File: simple_server.cpp
  * Description: Simple server application that takes in the port this server
- *              should use. The server itself can only serve a single client at
- *              a time, but this can be improved in the future.
+ *              should use. Every accepted client is served on its own thread,
+ *              so any number of clients can download files concurrently.
  */
 
 #include "rdt.h"
 #include <iostream>
+#include <thread>
 
 #define BACKLOG 10
 
 using namespace std;
 
 void printHelp(char **argv);
+void serveClient(RdtConnection *pClient);
 
 int main(int argc, char **argv)
 {
@@ -22,7 +24,21 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	// RDT_TRACE=path records every packet sent and received, for
+	// tools/rdt_trace_decode
+	const char *pTracePath = getenv("RDT_TRACE");
+	if(pTracePath && RdtTrace::Open(pTracePath, RTL_PACKET) == -1)
+	{
+		cout << "Couldn't create trace file " << pTracePath << "\n";
+	}
+
+	// RDT_IO_URING=1 moves the socket I/O onto io_uring
 	RdtConnection listener;
+	if(getenv("RDT_IO_URING"))
+	{
+		listener.SetIoBackend(EIB_URING);
+	}
+
 	if(listener.Initialize() == -1)
 	{
 		ERROR(ERR_SOCKET, true);
@@ -43,29 +59,39 @@ int main(int argc, char **argv)
 		ERROR(ERR_LISTEN, true);
 	}
 
-	sockaddr client_addr;
-	if(listener.Accept(&client_addr, sizeof(client_addr)) == -1)
+	while(1)
 	{
-		ERROR(ERR_ACCEPT, true);
+		RdtConnection *pClient = new RdtConnection;
+		sockaddr client_addr;
+		if(listener.Accept(*pClient, &client_addr, sizeof(client_addr)) == -1)
+		{
+			delete pClient;
+			ERROR(ERR_ACCEPT, true);
+		}
+
+		std::thread(serveClient, pClient).detach();
 	}
 
+	return 0;
+}
+
+void serveClient(RdtConnection *pClient)
+{
 	std::string filename;
-	if(listener.RecvRequest(filename) == -1)
+	if(pClient->RecvRequest(filename) == -1)
 	{
-		ERROR(ERR_RECV, true);
+		ERROR(ERR_RECV, false);
 	}
-
-	if(listener.SendFile(filename) == -1)
+	else if(pClient->SendFile(filename) == -1)
 	{
-		ERROR(ERR_SEND, true);
+		ERROR(ERR_SEND, false);
 	}
-
-	if(listener.Close() == -1)
+	else if(pClient->Close() == -1)
 	{
-		ERROR(ERR_CLOSE, true);
+		ERROR(ERR_CLOSE, false);
 	}
 
-	return 0;
+	delete pClient;
 }
 
 void printHelp(char **argv)
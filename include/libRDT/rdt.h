@@ -10,11 +10,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <cstring>
 #include <string>
+#include <vector>
+#include <functional>
 #include <unordered_map>
-#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <future>
 
 // If this is not defined, simply include a custom ERROR function/macro
 // in order to do something different when errors occur
@@ -23,6 +29,40 @@
 #endif
 
 #include "rdt_structures.h"
+#include "rdt_event_loop.h"
+#include "rdt_congestion.h"
+#include "rdt_packet_pool.h"
+#include "rdt_reassembly.h"
+#include "rdt_unacked_table.h"
+#include "rdt_trace.h"
+#include "rdt_pacer.h"
+#include "rdt_uring.h"
+
+class RdtConnection;
+
+/**
+ * @brief Callbacks RdtConnection::Process() runs as a connection makes
+ *        progress
+ *
+ * Any of them may be left empty. They run once everything waiting has been
+ * handled, so they may call back into the connection, and m_OnClose, which
+ * runs last, may even destroy it.
+ */
+struct RdtCallbacks
+{
+	// The SYNACK arrived, or on a listener, connections are waiting to be
+	// accepted
+	std::function<void(RdtConnection&)> m_OnConnect;
+	// Everything written has been ACKed
+	std::function<void(RdtConnection&)> m_OnSendComplete;
+	// A write failed with EAGAIN and the send queue has since half emptied
+	std::function<void(RdtConnection&)> m_OnWritable;
+	// New data arrived in order (on the connection or any stream), or the
+	// peer closed
+	std::function<void(RdtConnection&)> m_OnData;
+	// FINs have been exchanged both ways
+	std::function<void(RdtConnection&)> m_OnClose;
+};
 
 /**
  * @brief Class providing the top-level API
@@ -31,8 +71,14 @@
  * (which is similar to that of the Berkeley Sockets API) in order to have
  * reliable data transfer over UDP.
  *
- * @note This implementation does not currently perform flow or congestion
- * control.
+ * A listening connection owns a single UDP socket and demultiplexes incoming
+ * datagrams by peer address through a connection table, so any number of
+ * connections returned by Accept() can be serviced concurrently (for instance
+ * one per thread). The listener must outlive the connections it accepted.
+ *
+ * The send window is the smaller of the window chosen by a pluggable
+ * congestion controller (CUBIC unless another is selected) and the receive
+ * window advertised in the peer's ACKs.
  */
 class RdtConnection
 {
@@ -53,9 +99,187 @@ public:
 	 */
 	void Shutdown();
 
+	/**
+	 * @brief Use the given event loop to wait for I/O instead of a private one
+	 *
+	 * Lets several connections driven by the same thread sleep on one loop.
+	 *
+	 * @note Must be called before Initialize() or Accept(), and the loop must
+	 *       outlive the connection
+	 */
+	void SetEventLoop(RdtEventLoop *pLoop);
+
+	/**
+	 * @brief Allocate outgoing packets from the given pool instead of a
+	 *        private one
+	 *
+	 * Lets the connections of a server recycle one set of packet buffers. A
+	 * pool shared by connections on different threads must be created as
+	 * shared.
+	 *
+	 * @note Must be called while the connection has no packets in flight, and
+	 *       the pool must outlive the connection
+	 */
+	void SetPacketPool(RdtPacketPool *pPool);
+
+	/**
+	 * @brief Select one of the built-in congestion control algorithms
+	 * @note Should be called before any data is sent
+	 */
+	void SetCongestionControl(ECongestionControl algorithm);
+
+	/**
+	 * @brief Use a custom congestion controller
+	 * @note The connection takes ownership of pController
+	 */
+	void SetCongestionController(CongestionController *pController);
+
+	/**
+	 * @brief Set how many bytes past the first unread packet we will buffer
+	 *
+	 * What is left of it once the data received in order is taken off is
+	 * advertised to the sender in every ACK, and data beyond it is dropped
+	 * rather than buffered, so a slow reader holds back the sender.
+	 *
+	 * @note Must be called before any data arrives
+	 */
+	void SetReceiveWindow(uint32_t bytes);
+
+	/**
+	 * @brief Set how received data is ACKed
+	 *
+	 * Each ACK covers up to packets data packets. An ACK for fewer is sent
+	 * once delayUs have passed since the first of them arrived, or as soon
+	 * as no more datagrams are waiting if delayUs is 0. Packets that arrive
+	 * out of order, duplicates and the last packet of a message are always
+	 * ACKed straight away. Defaults to RDT_ACK_EVERY and RDT_ACK_DELAY_US.
+	 */
+	void SetAckPolicy(uint32_t packets, uint32_t delayUs);
+
+	/**
+	 * @brief Enable or disable pacing of the data this connection sends
+	 *
+	 * When enabled (the default), new data is spread out at 125% of the
+	 * congestion window per smoothed RTT, or at the congestion controller's
+	 * own pacing rate if it has one, rather than sent in bursts whenever the
+	 * window opens.
+	 */
+	void SetPacing(bool bEnable);
+
+	/**
+	 * @brief Limit the rate this connection sends data at
+	 * @param bytesPerSec Most bytes per second, 0 for no limit
+	 */
+	void SetMaxRate(uint64_t bytesPerSec);
+
+	/**
+	 * @brief Limit the combined rate all connections in the process send at
+	 * @param bytesPerSec Most bytes per second, 0 for no limit
+	 */
+	static void SetGlobalMaxRate(uint64_t bytesPerSec);
+
+	/**
+	 * @brief Enable or disable UDP segmentation offload (GSO and GRO)
+	 *
+	 * Enabled by default wherever the kernel supports it. Only affects a
+	 * connection that owns its socket; accepted connections follow their
+	 * listener.
+	 */
+	void SetSegmentationOffload(bool bEnable);
+
+	/**
+	 * @brief Enable or disable Explicit Congestion Notification
+	 *
+	 * Enabled by default. Datagrams are sent marked ECN-capable, and packets
+	 * that routers marked as having experienced congestion are reported
+	 * back to the sender, which backs off as it would on loss, but without
+	 * anything having to be resent. ECC_BBR, which ignores loss, instead
+	 * keeps no more than its bandwidth-delay estimate in flight for the
+	 * rest of the round. Like offload, only affects a connection
+	 * that owns its socket.
+	 */
+	void SetEcn(bool bEnable);
+
+	/**
+	 * @brief Select how the socket and file I/O is done
+	 *
+	 * With EIB_URING, a single io_uring receives datagrams continuously into
+	 * kernel-selected buffers, sends each batch as linked sendmsg operations
+	 * and writes RecvFile()'s data out in the background while more arrives.
+	 * Where the kernel lacks the io_uring features needed, the connection
+	 * quietly keeps to system calls; IoBackend() tells which is in use.
+	 *
+	 * @note Must be called before Initialize(), and only affects a
+	 *       connection that owns its socket; accepted connections follow
+	 *       their listener
+	 */
+	void SetIoBackend(ERdtIoBackend backend);
+
+	/**
+	 * @brief The backend actually in use
+	 */
+	ERdtIoBackend IoBackend() const;
+
+	/**
+	 * @brief Make calls return rather than block, for connections driven by
+	 *        the application's own event loop through Process()
+	 *
+	 * Connect() then returns -1 with errno EINPROGRESS once the SYN is sent,
+	 * and calls that would have to wait return -1 with errno EAGAIN. Write()
+	 * queues as much of the data as there is room for, while SendMessage()
+	 * queues a message whole or not at all; RecvMessage() only returns
+	 * whole messages, so messages larger than the receive window fail with
+	 * EMSGSIZE. Close() and WaitAndClose() return once the FIN is due to be
+	 * sent after the data queued before it. File transfers still block.
+	 */
+	void SetNonBlocking(bool bEnable);
+
+	/**
+	 * @brief Set the callbacks Process() runs
+	 */
+	void SetCallbacks(const RdtCallbacks &callbacks);
+
+	/**
+	 * @brief Fd that polls readable whenever Process() has work to do, to be
+	 *        watched by the application's own epoll or poll loop
+	 * @note Connections sharing an event loop share its fd, and each of
+	 *       them must be processed whenever it is readable
+	 */
+	int Fd() const;
+
+	/**
+	 * @brief RdtNow() time the next timer of the connection's event loop is
+	 *        due at, or 0 if none is scheduled
+	 *
+	 * Fd() also becomes readable then, so this is only needed by loops
+	 * that keep timers of their own rather than polling the fd.
+	 */
+	uint64_t NextDeadline() const;
+
+	/**
+	 * @brief Handles every waiting packet and expired timer without
+	 *        blocking, sends whatever the windows let out, and runs the
+	 *        callbacks
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Process();
+
+	/**
+	 * @brief Whether Process() has run m_OnClose, after which the connection
+	 *        may be shut down
+	 */
+	bool IsClosed() const{ return m_bClosed; }
+
+	/**
+	 * @brief Waits until Fd() is readable or timeoutMs have passed (-1 for
+	 *        no limit), then calls Process()
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Poll(int timeoutMs);
+
 	/**
 	 * @brief Begin 3-way handshake with specified host
-	 * @note Blocks until the SYNACK is received
+	 * @note Blocks until the SYNACK is received, unless non-blocking
 	 * @return 0 if successful, -1 if failed
 	 */
 	int Connect(const sockaddr *address, socklen_t address_len);
@@ -76,7 +300,7 @@ public:
 
 	/**
 	 * @brief Wait for FIN and then close connection
-	 * @note Blocks until FIN is received
+	 * @note Blocks until FIN is received, unless non-blocking
 	 * @return 0 if successful, -1 if failed
 	 */
 	int WaitAndClose();
@@ -88,6 +312,32 @@ public:
 	 */
 	int Bind(const sockaddr *address, socklen_t address_len);
 
+	/**
+	 * @brief Let other sockets bind the same address and port, each receiving
+	 *        the datagrams of some of the peers
+	 *
+	 * By default the kernel picks the socket by a hash of the peer's address
+	 * and port, so a peer keeps landing on the same socket while the group
+	 * stays the same.
+	 *
+	 * @note Must be called between Initialize() and Bind()
+	 * @return 0 if successful, -1 if failed
+	 */
+	int SetReusePort(bool bEnable);
+
+	/**
+	 * @brief Pick the socket of this reuseport group by the CPU a datagram
+	 *        arrives on rather than by hash
+	 *
+	 * Datagrams received on cpus[i] go to the i-th socket bound, and those on
+	 * any other CPU are spread by CPU number. A peer only keeps to one socket
+	 * if the NIC steers each flow to one CPU, as receive side scaling does.
+	 *
+	 * @note Must be called after Bind(), on any socket of the group
+	 * @return 0 if successful, -1 if failed
+	 */
+	int SetCpuSteering(const std::vector<int> &cpus);
+
 	/**
 	 * @brief Set up connection to listen for SYNs
 	 * @return 0 if successful, -1 if failed
@@ -96,10 +346,25 @@ public:
 
 	/**
 	 * @brief Accept first pending connection
+	 * @note The listener itself becomes connected to the client
 	 * @return 0 if successful, -1 if failed to connect
 	 */
 	int Accept(sockaddr *address, socklen_t address_len);
 
+	/**
+	 * @brief Accept first pending connection into a separate connection object
+	 *
+	 * The accepted connection shares the listener's UDP socket, leaving the
+	 * listener free to accept further clients. Accepted connections may be
+	 * driven from different threads, and are blocking or not as set on conn
+	 * rather than on the listener.
+	 *
+	 * @note Blocks until a pending connection is available, unless
+	 *       non-blocking
+	 * @return 0 if successful, -1 if failed to connect
+	 */
+	int Accept(RdtConnection &conn, sockaddr *address, socklen_t address_len);
+
 	/**
 	 * @brief Wait for a file request from the host
 	 * @note Blocks until a file request is received
@@ -109,20 +374,154 @@ public:
 
 	/**
 	 * @brief Send file contents to host
+	 *
+	 * The file is memory-mapped and packets reference their payload in the
+	 * mapping, so the file must not be truncated during the transfer.
+	 *
 	 * @note Blocks until the file has been completely transferred
 	 * @return 0 if succesful, -1 if failed
 	 */
 	int SendFile(std::string filename);
 
+	/**
+	 * @brief Send bytes from memory as part of a byte stream
+	 *
+	 * The data is copied into packets, so the buffer may be reused as soon
+	 * as this returns. Stream data, messages and files all travel in order
+	 * over the same connection.
+	 *
+	 * @note Unless non-blocking, blocks until the windows have let all of
+	 *       the data out, but not until it is ACKed
+	 * @return Bytes sent, or -1 if failed
+	 */
+	ssize_t Write(const void *pData, size_t len);
+
+	/**
+	 * @brief Write() gathering the data from count buffers
+	 */
+	ssize_t Writev(const iovec *pIov, int count);
+
+	/**
+	 * @brief Send bytes from memory as a single message, which the peer
+	 *        receives whole with RecvMessage() however many packets it takes
+	 * @note Blocks as Write() does
+	 * @return Bytes sent, or -1 if failed
+	 */
+	ssize_t SendMessage(const void *pData, size_t len);
+
+	/**
+	 * @brief SendMessage() gathering the message from count buffers
+	 */
+	ssize_t SendMessagev(const iovec *pIov, int count);
+
+	/**
+	 * @brief Receive up to len bytes of the byte stream
+	 *
+	 * Message boundaries are ignored, so this also reads the data of
+	 * messages and files as a stream.
+	 *
+	 * @note Blocks until some data has arrived in order, unless non-blocking
+	 * @return Bytes received, 0 once the peer has closed and everything it
+	 *         sent has been read, or -1 if failed
+	 */
+	ssize_t Read(void *pBuf, size_t len);
+
+	/**
+	 * @brief Read() scattering the data over count buffers
+	 */
+	ssize_t Readv(const iovec *pIov, int count);
+
+	/**
+	 * @brief Receive the next message
+	 *
+	 * Whatever part of the message doesn't fit in the buffer is discarded,
+	 * as with recv() on a datagram socket.
+	 *
+	 * @note Blocks until the whole message has arrived, unless non-blocking
+	 * @return Bytes received, 0 if the peer closed first, or -1 if failed
+	 */
+	ssize_t RecvMessage(void *pBuf, size_t len);
+
+	/**
+	 * @brief RecvMessage() scattering the message over count buffers
+	 */
+	ssize_t RecvMessagev(const iovec *pIov, int count);
+
+	/**
+	 * @brief Write() on one of the connection's streams
+	 *
+	 * Each stream is an independent byte stream within the connection,
+	 * identified by any number both sides agree on and opened by simply
+	 * writing to it. Streams share the connection's windows, congestion
+	 * control and retransmissions, but data is read from a stream as soon as
+	 * everything sent before it on that stream has arrived, so a lost packet
+	 * only holds up its own stream. Unread data of every stream takes up the
+	 * one receive window, so the reader must keep reading all of them. The
+	 * receiver buffers packets of at most RDT_MAX_STREAMS streams at once and
+	 * drops those of any further stream until one of them has been read
+	 * out. Stream packets carry 8 bytes less data. The connection's own data
+	 * (written with Write(), SendMessage() or SendFile()) keeps waiting for
+	 * everything sent before it on any stream.
+	 *
+	 * @note Blocks as Write() does
+	 * @return Bytes sent, or -1 if failed
+	 */
+	ssize_t WriteStream(uint32_t stream, const void *pData, size_t len);
+
+	/**
+	 * @brief SendMessage() on one of the connection's streams
+	 */
+	ssize_t SendStreamMessage(uint32_t stream, const void *pData, size_t len);
+
+	/**
+	 * @brief Read() from one of the connection's streams
+	 * @return Bytes received, 0 once the peer has closed and everything it
+	 *         sent on the stream has been read, or -1 if failed
+	 */
+	ssize_t ReadStream(uint32_t stream, void *pBuf, size_t len);
+
+	/**
+	 * @brief RecvMessage() from one of the connection's streams
+	 */
+	ssize_t RecvStreamMessage(uint32_t stream, void *pBuf, size_t len);
+
+	/**
+	 * @brief Streams with data that can be read straight away, in no
+	 *        particular order, for instance from m_OnData
+	 */
+	std::vector<uint32_t> ReadableStreams() const;
+
 	/**
 	 * @brief Send FIN
-	 * @note Blocks until the FIN-ACK is received
+	 * @note Blocks until everything sent has been ACKed and the FIN-ACK is
+	 *       received, unless non-blocking, in which case m_OnClose reports
+	 *       when the connection may be shut down
 	 * @return 0 if successful, -1 if failed
 	 */
 	int Close();
 
 private:
 	int _Init();
+	int _Accept(RdtConnection &conn, sockaddr *address, socklen_t address_len);
+
+	/**
+	 * @brief Reads datagrams from the UDP socket, routing each one to the
+	 *        connection registered for its peer address
+	 *
+	 * Must be called on the connection owning the socket. Packets for other
+	 * connections are queued on their inbound buffer, and SYNs are queued as
+	 * pending connections if listening.
+	 *
+	 * @return EDR_PACKET if pkt holds a packet for pConn, EDR_ROUTED if
+	 *         datagrams were read but none were for pConn, EDR_EMPTY if there
+	 *         was nothing to read, EDR_ERROR on error
+	 */
+	int Demux(RdtConnection *pConn, RdtPacket &pkt);
+
+	/**
+	 * @brief Hands a packet read by Demux() to the connection for its peer
+	 */
+	void Route(RdtConnection *pConn, const sockaddr &addr, const RdtPacket &pkt);
 
 	/**
 	 * @brief Updates the rdt state (sends/receives ACKs/data/SYNACKs/etc)
@@ -131,42 +530,424 @@ private:
 	 * will behave as expected. Note that the typical socket API does not contain this
 	 * function because such operations are performed by the OS usually.
 	 *
+	 * If no packet is available, sleeps in the event loop until one arrives, the
+	 * next resend is due, or wakeTime (if nonzero) passes.
+	 *
 	 * @return -1 on error, 0 for normal call
 	 */
-	int Update(RdtPacket *pPkt=nullptr);
+	int Update(RdtPacket *pPkt=nullptr, uint64_t wakeTime=0);
+
+	/**
+	 * @brief Update() without the sleep: resends what is due and handles the
+	 *        next packet addressed to this connection, if any
+	 * @return As Update(), or EUR_EMPTY if no packet was waiting
+	 */
+	int Receive(RdtPacket *pPkt);
+
+	/**
+	 * @brief Queues a packet to be sent with the next Flush()
+	 *
+	 * The queue is flushed once it holds RDT_IO_BATCH packets, and before
+	 * Update() sleeps, so packets are never left waiting on the peer.
+	 *
+	 * @param pPayload If set, pPkt only holds the header and the payload is
+	 *        gathered from here whenever the packet is (re)sent, so it must
+	 *        stay valid until the packet is ACKed
+	 */
+	bool Send(RdtPacket *pPkt, bool isResend=false, bool isSyn=false,
+			  const char *pPayload=nullptr);
+	/**
+	 * @brief Packetizes data from count buffers into the byte stream, or as
+	 *        one message ending in a packet marked FLAG_LAST if bMessage
+	 * @param stream Stream to send on, -1 for the connection's own data
+	 * @return Bytes sent, or -1 if failed
+	 */
+	ssize_t SendData(const iovec *pIov, int count, bool bMessage, int64_t stream=-1);
+
+	/**
+	 * @brief Reads in-order data into count buffers, up to and including
+	 *        the end of the next message if bMessage
+	 * @param stream Stream to read from, -1 for the connection's own data
+	 * @return Bytes read, 0 at the end of the stream, or -1 if failed
+	 */
+	ssize_t RecvData(const iovec *pIov, int count, bool bMessage, int64_t stream=-1);
+
+	/**
+	 * @brief Moves the buffers from pIov[first] on past bytes, and past any
+	 *        that are empty
+	 * @return Index of the first buffer with room left, count if none
+	 */
+	static int AdvanceIov(iovec *pIov, int count, int first, size_t bytes);
+
+	/**
+	 * @brief Sends queued packets as the windows let them out, and the FIN
+	 *        once a non-blocking Close() has been called and everything
+	 *        before it has been ACKed
+	 */
+	void SendQueued();
+
+	/**
+	 * @brief Runs Update() until every queued packet has been sent
+	 * @return 0 if successful, -1 if failed
+	 */
+	int DrainSendQueue();
+
+	/**
+	 * @brief Runs Update() until every packet we sent has been ACKed
+	 * @return 0 if successful, -1 if failed
+	 */
+	int WaitForAcks();
+
+	/**
+	 * @brief Sends a FIN after everything sent so far
+	 * @return 0 if successful, -1 if no packet could be allocated
+	 */
+	int SendFin();
+
+	/**
+	 * @brief ACKs straight away if reading has opened our receive window by
+	 *        half of m_RecvWnd since it was last advertised
+	 */
+	void UpdateWindow();
+
+	/**
+	 * @brief Queues an ACK echoing hdr, which also reports the cumulative ACK
+	 *        and received ranges once we know where incoming data starts
+	 */
+	void SendAck(const RdtHeader &hdr);
+
+	/**
+	 * @brief Sends the ACK for the data received since the last one, if any
+	 */
+	void SendPendingAck();
+
+	/**
+	 * @brief Sends all queued packets with as few sendmmsg calls as possible
+	 * @return true if successful, false if any packet failed to send
+	 */
+	bool Flush();
+
+	/**
+	 * @brief Flush()es and makes Fd() readable once the next timer is due,
+	 *        since a non-blocking connection has no call sleeping until then
+	 */
+	void FlushAndArm();
+
+	/**
+	 * @brief Probes for GSO and enables GRO on our socket, as m_bOffload allows
+	 */
+	void ConfigureOffload();
+
+	/**
+	 * @brief Whether both the congestion and flow-control windows have room
+	 *        for another len bytes
+	 */
+	bool CanSend(uint16_t len);
+
+	/**
+	 * @brief Records the addresses of a newly set up connection in the trace
+	 */
+	void TraceConnect();
+
+	/**
+	 * @brief Whether a data packet with this header was already received
+	 */
+	bool IsDuplicate(const RdtHeader &hdr) const;
+
+	/**
+	 * @brief Takes a packet from m_pPool, running Update() until one is free
+	 *        unless non-blocking
+	 * @return nullptr on error, or with errno EAGAIN if none is free
+	 */
+	RdtPacket *AllocPacket();
+
+	/**
+	 * @brief Returns the packet in an unacked slot to the pool it came from
+	 */
+	void FreePacket(int slot);
+
+	/**
+	 * @brief Returns all unacked packets to the pool and forgets them
+	 */
+	void ClearUnacked();
+
+	/**
+	 * @brief Sets the ECN marking of our socket's datagrams, and whether
+	 *        the marking of received ones is reported
+	 */
+	void ConfigureEcn();
+
+	/**
+	 * @brief Sets up m_Uring for our socket if m_IoBackend asks for it
+	 */
+	void ConfigureUring();
+
+	/**
+	 * @brief Fd our event loop watches for datagrams: the socket, or the
+	 *        owner's ring's eventfd
+	 */
+	int WatchedFd() const;
+
+	/**
+	 * @brief Rate our pacer should let data out at, 0 for unlimited
+	 */
+	uint64_t PacingRate() const;
+
+	/**
+	 * @brief Fills m_pRecvBatch from the UDP socket (or ring) without blocking
+	 * @return Number of messages read, 0 if none were waiting, -1 on error
+	 */
+	int Recv();
+
+	/**
+	 * @brief Resends every packet whose timer on our event loop's wheel has
+	 *        expired, including those of other connections sharing the loop,
+	 *        and sends any ACKs held for m_AckDelay
+	 */
+	void Resend(uint64_t currTime);
+	void Resend(int slot, uint64_t currTime);
 
-	bool Send(RdtPacket *pPkt, bool isResend=false, bool isSyn=false);
-	bool Recv(RdtPacket &pkt, sockaddr *pAddr=nullptr);
-	void Resend(clock_t currTime);
-	void Ack(UnackedPacket *pUnacked);
+	/**
+	 * @brief Resends a packet deemed lost, without the RTO backoff of Resend()
+	 */
+	void Retransmit(int slot, uint64_t currTime);
+
+	/**
+	 * @brief Retransmits unacked packets that were sent long enough before
+	 *        (RACK), or RDT_REORDER_THRESH full packets before, the newest
+	 *        packet known to have arrived
+	 */
+	void DetectLosses(uint64_t currTime);
+
+	/**
+	 * @brief Schedules a tail-loss probe two smoothed RTTs from now, if that
+	 *        comes before the RTO and anything is unacked
+	 */
+	void ArmProbe(uint64_t currTime);
+
+	/**
+	 * @brief Resends the newest unacked packet, so that the ACK it draws
+	 *        reveals whether any packets before it were lost
+	 */
+	void SendProbe(uint64_t currTime);
+
+	void Ack(int slot, uint64_t rtt=0);
+
+	/**
+	 * @brief ACKs every unacked packet lying entirely within [start, end)
+	 */
+	void AckRange(uint32_t start, uint32_t end);
 
 private:
 	int m_UdpSocket;
-	fd_set m_fdsMain;
+	RdtEventLoop m_EventLoop;
+	RdtEventLoop *m_pEventLoop; // Loop to sleep in, m_EventLoop unless shared
+	RdtPacketPool m_Pool;
+	RdtPacketPool *m_pPool; // Pool to allocate from, m_Pool unless shared
+	RdtPacketPool m_HeaderPool; // Header-only packets whose payload is mapped
 	sockaddr m_LocalAddr;
 	sockaddr *m_pAddr;
 	socklen_t m_AddrLen;
+	RdtIoBatch *m_pSendBatch; // Packets queued by Send()
+	RdtIoBatch *m_pRecvBatch; // Only allocated by the socket owner
+	bool m_bOffload; // Whether GSO/GRO may be used
+	std::atomic<bool> m_bGso; // Whether our socket segments UDP_SEGMENT sends
+	bool m_bGro;     // Whether our socket returns UDP_GRO aggregates
+	bool m_bEcn;     // Whether our socket marks datagrams ECN-capable
+	ERdtIoBackend m_IoBackend; // Requested by SetIoBackend()
+	RdtUring m_Uring;          // Active if our socket's I/O goes through it
+	uint32_t m_CeCount;     // CE-marked data packets received
+	uint32_t m_PeerCeCount; // CE-marked packets the peer last reported
+	uint32_t m_TraceId; // Identifies the connection in RdtTrace records
 
-	uint16_t m_WndSize;
-	uint16_t m_WndCurr;
+	uint32_t m_WndSize; // Current window, as set by m_pCongestion
+	uint32_t m_WndCurr; // Bytes currently in flight
+	CongestionController *m_pCongestion;
 
 	// Listener variables
 	bool m_IsListener;
 	CircularBuffer<PendingConnection> m_PendingConnections;
 
+	// Connection table variables (used by the connection owning the socket)
+	RdtConnection *m_pListener; // Owner of m_UdpSocket, this if not accepted
+	std::unordered_map<PeerKey,RdtConnection*,PeerKeyHash> m_Connections;
+	std::mutex m_Mutex; // Guards socket reads, the table & all queues
+	CircularBuffer<RdtPacket> m_Inbound; // Packets routed here by Demux()
+	bool m_bInboundDrained; // Whether Demux() just took our last queued packet
+
 	// Ack variables
-	CircularBuffer<UnackedPacket> m_UnackedPackets;
-	std::unordered_map<uint16_t,uint16_t> m_SeqToIndex; // Maps seq# to buffer index
-	clock_t m_EarliestTimeout;
-	UnackedPacket *m_pEarliestPacket;
-	UnackedPacket *m_pLatestPacket;
-	uint16_t m_NextSeq;
-	uint16_t m_MinUnacked;
+	RdtUnackedTable m_Unacked;
+	uint32_t m_NextSeq;
 	int m_SynIndex;
+	bool m_bSendSynced; // Whether our first data packet, with FLAG_FIRST, went out
+	std::unordered_map<uint32_t,uint32_t> m_StreamLastSeq; // Last packet sent on each stream
+	RttEstimator m_Rtt;
+	uint64_t m_RackSendTime; // Latest send time of a packet known to have arrived
+	uint32_t m_RackEndSeq;   // Highest sequence number known to have arrived
+	RdtTimer m_ProbeTimer;   // Fires the tail-loss probe
+
+	// Pacing variables
+	RdtPacer m_Pacer;
+	bool m_bPacing;
+	uint64_t m_MaxRate;    // Bytes per second, 0 if unlimited
+	RdtTimer m_PaceTimer;  // Wakes us once the pacer lets the next packet out
+	bool m_bPaceDue;       // m_PaceTimer fired since CanSend() last checked
+	RdtHeader m_AckHdr; // Latest data packet received, echoed by the next ACK
+	bool m_bAckPending;
+	bool m_bAckNow;       // Whether the pending ACK is due on the next Update()
+	uint32_t m_AckCount;  // Data packets the pending ACK covers
+	uint32_t m_AckEvery;  // Data packets covered by a single ACK
+	uint64_t m_AckDelay;  // Longest an ACK is held in ns, 0 for one batch
+	RdtTimer m_AckTimer;  // Sends the pending ACK once m_AckDelay is up
 
 	bool m_ReceivedFIN;
 
-	std::list<uint16_t> m_ReceivedList;
+	// Non-blocking variables
+	bool m_bNonBlocking;
+	RdtCallbacks m_Callbacks;
+	CircularBuffer<RdtPacket*> m_SendQueue; // Written, awaiting room in the windows
+	bool m_bConnected;    // Whether the SYNACK has arrived
+	bool m_bSendPending;  // Written data not yet reported ACKed to m_OnSendComplete
+	bool m_bWriteBlocked; // Whether a write failed for lack of queue room
+	bool m_bClosing;      // Whether Close() is waiting to send the FIN
+	bool m_bFinSent;
+	bool m_bFinAcked;
+	bool m_bClosedFirst;  // Whether our FIN went out before the peer's came in
+	uint64_t m_LingerEnd; // When m_OnClose is due, 0 until the FINs are exchanged
+	RdtTimer m_LingerTimer;
+	bool m_bClosed;       // Whether m_OnClose has run
+
+	// Flow control variables
+	uint32_t m_RecvWnd;        // Bytes past the first unread packet we will buffer
+	bool m_bRecvSynced;        // Whether we know where the peer's data starts
+	uint32_t m_AdvertisedEdge; // End of the receive window we last advertised
+	uint32_t m_PeerCumAck;     // Last window advertised by the peer
+	uint32_t m_PeerWnd;
+	bool m_bPeerWndValid;
+	RdtReassemblyBuffer m_Reassembly; // Data received but not yet read
+};
+
+enum ERdtSteering
+{
+	ERS_HASH, // The kernel's hash of the peer's address and port
+	ERS_CPU   // The CPU the datagram arrived on, see SetCpuSteering()
+};
+
+/**
+ * @brief Server runtime spreading its peers over worker threads
+ *
+ * Each worker owns a listener on its own SO_REUSEPORT socket bound to the
+ * same address, along with its own event loop, packet pool and connection
+ * table, so the kernel shares the peers out between the workers and no
+ * state is shared between them. Workers are pinned to the CPUs the process
+ * may run on, one each, and drive their connections through the
+ * non-blocking API (see RdtConnection::SetNonBlocking()), so a worker
+ * serves any number of peers on one thread.
+ *
+ * Every connection a worker accepts is handed to the accept handler on that
+ * worker's thread, which sets its callbacks and starts it off; from then on
+ * the connection is only ever touched by that thread. Connections are
+ * destroyed by their worker once m_OnClose has run, or when Process()
+ * fails.
+ */
+class RdtServer
+{
+public:
+	RdtServer();
+	~RdtServer();
+
+	RdtServer(const RdtServer&) = delete;
+	RdtServer &operator=(const RdtServer&) = delete;
+
+	/**
+	 * @brief Set how many workers Start() creates, 0 (the default) for one
+	 *        per CPU the process may run on
+	 */
+	void SetWorkers(int count);
+
+	/**
+	 * @brief Enable or disable pinning each worker to its own CPU
+	 *
+	 * Enabled by default. Workers beyond the number of CPUs share them in
+	 * turn.
+	 */
+	void SetCpuAffinity(bool bEnable);
+
+	/**
+	 * @brief Select how datagrams are shared out between the workers'
+	 *        sockets, ERS_HASH by default
+	 *
+	 * ERS_CPU keeps a peer's datagrams on the CPU whose worker serves them,
+	 * but needs the NIC to steer each flow to one CPU.
+	 */
+	void SetSteering(ERdtSteering steering);
+
+	/**
+	 * @brief Set a function run on each worker's listener before it is
+	 *        initialized, to pick options such as SetIoBackend() or
+	 *        SetSegmentationOffload(), which its connections follow
+	 */
+	void SetListenerSetup(const std::function<void(RdtConnection&)> &setup);
+
+	/**
+	 * @brief Binds every worker's socket to address and starts serving
+	 * @param onAccept Run on the worker's thread with each new connection
+	 * @return 0 if successful, -1 if failed, in which case nothing is left
+	 *         running
+	 */
+	int Start(const sockaddr *address, socklen_t address_len, int backlog,
+		const std::function<void(RdtConnection&)> &onAccept);
+
+	/**
+	 * @brief Stops the workers, shutting down their connections
+	 */
+	void Stop();
+
+	/**
+	 * @brief Number of workers running
+	 */
+	int Workers() const{ return (int)m_Workers.size(); }
+
+private:
+	struct Worker
+	{
+		Worker() : m_Pool(RDT_WORKER_POOL), m_Cpu(-1){}
+
+		RdtEventLoop m_Loop;
+		RdtPacketPool m_Pool;
+		RdtConnection m_Listener;
+		std::vector<RdtConnection*> m_Connections;
+		std::thread m_Thread;
+		int m_Cpu; // CPU the worker is pinned to, -1 if not
+	};
+
+	/**
+	 * @brief Sets up pWorker's listener on the worker's own thread, so its
+	 *        socket's I/O is done there
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Listen(Worker *pWorker, const sockaddr *address, socklen_t address_len, int backlog);
+
+	/**
+	 * @brief Accepts every connection waiting on pWorker's listener
+	 */
+	void AcceptAll(Worker *pWorker);
+
+	/**
+	 * @brief Body of a worker thread
+	 * @param pBound Set to Listen()'s result once the listener is bound
+	 */
+	void Run(Worker *pWorker, const sockaddr *address, socklen_t address_len,
+		int backlog, std::promise<int> *pBound);
+
+private:
+	int m_WorkerCount;
+	bool m_bAffinity;
+	ERdtSteering m_Steering;
+	std::function<void(RdtConnection&)> m_ListenerSetup;
+	std::function<void(RdtConnection&)> m_OnAccept;
+	std::vector<Worker*> m_Workers;
+	std::atomic<bool> m_bStop;
 };
 
 #endif //_RDT_H_
@@ -4,8 +4,11 @@
 
 #include "rdt.h"
 #include <unistd.h>
-#include <iostream>
-#include <fstream>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/filter.h>
 
 enum EUpdateResult
 {
@@ -16,20 +19,104 @@ enum EUpdateResult
 	EUR_DATA,
 	EUR_FIN,
 	EUR_FINACK,
-	EUR_DROPPED
+	EUR_DROPPED,
+	EUR_EMPTY
 };
 
+enum EDemuxResult
+{
+	EDR_ERROR = -1,
+	EDR_EMPTY,
+	EDR_PACKET,
+	EDR_ROUTED
+};
+
+/**
+ * @brief Random initial sequence number spanning the whole 32-bit space
+ */
+static uint32_t RandomSeq()
+{
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+/**
+ * @brief Size of the datagrams in a message read from the socket, which is
+ *        less than its length if UDP_GRO coalesced several datagrams
+ */
+static size_t GroSegmentSize(msghdr &hdr, size_t len)
+{
+	for(cmsghdr *pCmsg = CMSG_FIRSTHDR(&hdr); pCmsg; pCmsg = CMSG_NXTHDR(&hdr, pCmsg))
+	{
+		if(pCmsg->cmsg_level == SOL_UDP && pCmsg->cmsg_type == UDP_GRO)
+		{
+			int size;
+			memcpy(&size, CMSG_DATA(pCmsg), sizeof(size));
+			if(size > 0){ return size; }
+		}
+	}
+
+	return len ? len : 1;
+}
+
+/**
+ * @brief Whether a message read from the socket arrived with a CE mark
+ */
+static bool IsCeMarked(msghdr &hdr)
+{
+	for(cmsghdr *pCmsg = CMSG_FIRSTHDR(&hdr); pCmsg; pCmsg = CMSG_NXTHDR(&hdr, pCmsg))
+	{
+		if(pCmsg->cmsg_level == IPPROTO_IP && pCmsg->cmsg_type == IP_TOS)
+		{
+			return (*CMSG_DATA(pCmsg) & RDT_ECN_MASK) == RDT_ECN_CE;
+		}
+	}
+
+	return false;
+}
+
+static std::atomic<uint32_t> s_NextTraceId(1);
+
+// Shared by every connection; the rate is kept apart so connections only
+// take the lock while a limit is set
+static RdtPacer s_GlobalPacer;
+static std::mutex s_GlobalPacerMutex;
+static std::atomic<uint64_t> s_GlobalMaxRate(0);
+
 RdtConnection::RdtConnection() :
-	m_UdpSocket(-1), m_IsListener(false), m_pAddr(nullptr),
-	m_WndSize(RDT_WNDSIZE), m_WndCurr(0), m_EarliestTimeout(0),
-	m_pEarliestPacket(nullptr), m_pLatestPacket(nullptr), m_NextSeq(0),
-	m_MinUnacked(-1), m_SynIndex(-1), m_ReceivedFIN(false)
+	m_UdpSocket(-1), m_pEventLoop(&m_EventLoop),
+	m_Pool(RDT_MAX_UNACKED + RDT_SEND_QUEUE + 1), m_pPool(&m_Pool),
+	m_HeaderPool(RDT_MAX_UNACKED + 1, false, sizeof(RdtHeader)), m_pAddr(nullptr),
+	m_pSendBatch(nullptr), m_pRecvBatch(nullptr), m_bOffload(true),
+	m_bGso(false), m_bGro(false), m_bEcn(true), m_IoBackend(EIB_SOCKETS),
+	m_CeCount(0), m_PeerCeCount(0), m_TraceId(s_NextTraceId++),
+	m_WndSize(RDT_WNDSIZE), m_WndCurr(0), m_IsListener(false),
+	m_pListener(this), m_bInboundDrained(true),
+	m_NextSeq(0), m_SynIndex(-1), m_bSendSynced(false),
+	m_RackSendTime(0), m_RackEndSeq(0),
+	m_bPacing(true), m_MaxRate(0), m_bPaceDue(false),
+	m_bAckPending(false), m_bAckNow(false), m_AckCount(0),
+	m_AckEvery(RDT_ACK_EVERY), m_AckDelay(RDT_ACK_DELAY_US * (uint64_t)1000),
+	m_ReceivedFIN(false), m_bNonBlocking(false),
+	m_bConnected(false), m_bSendPending(false), m_bWriteBlocked(false),
+	m_bClosing(false), m_bFinSent(false), m_bFinAcked(false), m_bClosedFirst(false),
+	m_LingerEnd(0), m_bClosed(false),
+	m_RecvWnd(RDT_MAX_WNDSIZE), m_bRecvSynced(false), m_AdvertisedEdge(0),
+	m_PeerCumAck(0), m_PeerWnd(0), m_bPeerWndValid(false)
 {
+	m_pCongestion = CongestionController::Create(ECC_CUBIC);
+	m_WndSize = m_pCongestion->Window();
+	m_AckTimer.m_pOwner = this;
+	m_ProbeTimer.m_pOwner = this;
+	m_PaceTimer.m_pOwner = this;
+	m_LingerTimer.m_pOwner = this;
 }
 
 RdtConnection::~RdtConnection()
 {
 	Shutdown();
+	delete m_pCongestion;
+	delete m_pSendBatch;
+	delete m_pRecvBatch;
 }
 
 int RdtConnection::Initialize()
@@ -60,12 +147,37 @@ int RdtConnection::_Init()
 		firstInit = false;
 	}
 
-	FD_ZERO(&m_fdsMain);
-	FD_SET(m_UdpSocket, &m_fdsMain);
+	if(m_pEventLoop->Initialize() == -1)
+	{
+		return -1;
+	}
+
+	if(!m_pSendBatch){ m_pSendBatch = new RdtIoBatch(RDT_IO_BATCH, sizeof(RdtPacket)); }
+	m_pSendBatch->m_Count = 0;
+	if(m_pListener == this)
+	{
+		ConfigureUring();
+		ConfigureOffload();
+		ConfigureEcn();
+	}
 
-	m_ReceivedList.clear();
+	if(m_pEventLoop->Add(WatchedFd(), m_pListener->m_Uring.IsActive()) == -1)
+	{
+		return -1;
+	}
 
-	m_UnackedPackets.Initialize((MULT<RDT_WNDSIZE,2>::val / RDT_MSS) + 1);
+	m_Unacked.Initialize(RDT_MAX_UNACKED);
+	m_Inbound.Initialize(RDT_INBOUND_QUEUE);
+	m_SendQueue.Initialize(RDT_SEND_QUEUE + 1);
+	m_bConnected = false;
+	m_bSendPending = false;
+	m_bWriteBlocked = false;
+	m_bClosing = false;
+	m_bFinSent = false;
+	m_bFinAcked = false;
+	m_bClosedFirst = false;
+	m_LingerEnd = 0;
+	m_bClosed = false;
 	return 0;
 }
 
@@ -73,6 +185,26 @@ void RdtConnection::Shutdown()
 {
 	if(m_UdpSocket != -1)
 	{
+		Flush();
+		m_pEventLoop->Remove(WatchedFd());
+	}
+
+	if(m_pListener != this)
+	{
+		// Accepted connection; leave the listener's socket open
+		std::lock_guard<std::mutex> lock(m_pListener->m_Mutex);
+		auto iter = m_pListener->m_Connections.find(PeerKey(m_LocalAddr));
+		if(iter != m_pListener->m_Connections.end() && iter->second == this)
+		{
+			m_pListener->m_Connections.erase(iter);
+		}
+
+		m_pListener = this;
+		m_UdpSocket = -1;
+	}
+	else if(m_UdpSocket != -1)
+	{
+		m_Uring.Shutdown();
 		if(close(m_UdpSocket) == -1)
 		{
 			ERROR(ERR_CLOSE, false);
@@ -82,22 +214,257 @@ void RdtConnection::Shutdown()
 	}
 
 	m_pAddr = nullptr;
+	m_Connections.clear();
+	ClearUnacked();
+
+	RdtPacket *pQueued;
+	while(m_SendQueue.Pop(&pQueued))
+	{
+		m_pPool->Free(pQueued);
+	}
+
+	m_pEventLoop->Timers().Cancel(&m_AckTimer);
+	m_pEventLoop->Timers().Cancel(&m_LingerTimer);
+	m_bAckPending = false;
 
 	m_PendingConnections.Shutdown();
 }
 
+void RdtConnection::SetEventLoop(RdtEventLoop *pLoop)
+{
+	m_pEventLoop = pLoop ? pLoop : &m_EventLoop;
+}
+
+void RdtConnection::SetPacketPool(RdtPacketPool *pPool)
+{
+	m_pPool = pPool ? pPool : &m_Pool;
+}
+
+void RdtConnection::SetCongestionControl(ECongestionControl algorithm)
+{
+	SetCongestionController(CongestionController::Create(algorithm));
+}
+
+void RdtConnection::SetCongestionController(CongestionController *pController)
+{
+	if(pController == nullptr || pController == m_pCongestion){ return; }
+
+	delete m_pCongestion;
+	m_pCongestion = pController;
+	m_pCongestion->SetMaxWindow(RDT_MAX_WNDSIZE);
+	m_WndSize = m_pCongestion->Window();
+}
+
+void RdtConnection::SetSegmentationOffload(bool bEnable)
+{
+	m_bOffload = bEnable;
+	if(m_pListener == this && m_UdpSocket != -1)
+	{
+		ConfigureOffload();
+	}
+}
+
+void RdtConnection::SetIoBackend(ERdtIoBackend backend)
+{
+	m_IoBackend = backend;
+}
+
+ERdtIoBackend RdtConnection::IoBackend() const
+{
+	return m_pListener->m_Uring.IsActive() ? EIB_URING : EIB_SOCKETS;
+}
+
+void RdtConnection::SetReceiveWindow(uint32_t bytes)
+{
+	// Keep room for at least two packets so the window can always advance
+	m_RecvWnd = std::min(std::max(bytes, (uint32_t)MULT<RDT_MAX_PKTSIZE,2>::val),
+						 (uint32_t)RDT_MAX_WNDSIZE);
+}
+
+void RdtConnection::SetAckPolicy(uint32_t packets, uint32_t delayUs)
+{
+	m_AckEvery = std::max(packets, 1u);
+	m_AckDelay = delayUs * (uint64_t)1000;
+}
+
+void RdtConnection::SetEcn(bool bEnable)
+{
+	m_bEcn = bEnable;
+	if(m_pListener == this && m_UdpSocket != -1)
+	{
+		ConfigureEcn();
+	}
+}
+
+void RdtConnection::SetPacing(bool bEnable)
+{
+	m_bPacing = bEnable;
+}
+
+void RdtConnection::SetMaxRate(uint64_t bytesPerSec)
+{
+	m_MaxRate = bytesPerSec;
+}
+
+void RdtConnection::SetGlobalMaxRate(uint64_t bytesPerSec)
+{
+	std::lock_guard<std::mutex> lock(s_GlobalPacerMutex);
+	s_GlobalPacer.SetRate(bytesPerSec);
+	s_GlobalMaxRate = bytesPerSec;
+}
+
+void RdtConnection::SetNonBlocking(bool bEnable)
+{
+	m_bNonBlocking = bEnable;
+}
+
+void RdtConnection::SetCallbacks(const RdtCallbacks &callbacks)
+{
+	m_Callbacks = callbacks;
+}
+
+int RdtConnection::Fd() const
+{
+	return m_pEventLoop->Fd();
+}
+
+uint64_t RdtConnection::NextDeadline() const
+{
+	return m_pEventLoop->Timers().NextDeadline();
+}
+
+int RdtConnection::Process()
+{
+	// Take the wakeups first, so anything that arrives from here on makes
+	// Fd() readable again
+	if(m_pEventLoop->Drain() == -1)
+	{
+		return -1;
+	}
+
+	bool bConnect = false, bData = false;
+	int result;
+	while((result = Receive(nullptr)) != EUR_EMPTY)
+	{
+		switch(result)
+		{
+		case -1:
+			return -1;
+		case EUR_SYNACK:
+			if(!m_bConnected)
+			{
+				m_bConnected = true;
+				TraceConnect();
+				bConnect = true;
+			}
+			break;
+		case EUR_DATA:
+			bData = true;
+			break;
+		case EUR_FIN:
+			// As in Close(), a FIN after ours means the peer has ours
+			m_bFinAcked = m_bFinAcked || m_bFinSent;
+			bData = true;
+			break;
+		case EUR_FINACK:
+			m_bFinAcked = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Having closed first, linger as Close() does before reporting the
+	// connection closed, so that the peer's FIN is still ACKed if our
+	// FIN-ACK is lost
+	if(m_LingerEnd == 0 && m_bFinSent && m_bFinAcked && m_ReceivedFIN)
+	{
+		m_LingerEnd = RdtNow();
+		if(m_bClosedFirst)
+		{
+			m_LingerEnd += 2 * std::max(m_Rtt.Rto(), RDT_RTO_MS * RDT_NS_PER_MS);
+			m_pEventLoop->Timers().Schedule(&m_LingerTimer, m_LingerEnd);
+		}
+	}
+
+	SendQueued();
+	FlushAndArm();
+
+	if(m_IsListener && m_Callbacks.m_OnConnect)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		bConnect = bConnect || m_PendingConnections.Size() > 0;
+	}
+
+	bool bWritable = m_bWriteBlocked && m_SendQueue.Size() <= RDT_SEND_QUEUE / 2;
+	bool bSendComplete = m_bSendPending && m_SendQueue.Size() == 0 && m_Unacked.Size() == 0;
+	bool bClosed = !m_bClosed && m_LingerEnd != 0 && RdtNow() >= m_LingerEnd;
+	if(bWritable){ m_bWriteBlocked = false; }
+	if(bSendComplete){ m_bSendPending = false; }
+	if(bClosed){ m_bClosed = true; }
+
+	// The callbacks run last, since they may call back into the connection
+	if(bConnect && m_Callbacks.m_OnConnect){ m_Callbacks.m_OnConnect(*this); }
+	if(bWritable && m_Callbacks.m_OnWritable){ m_Callbacks.m_OnWritable(*this); }
+	if(bSendComplete && m_Callbacks.m_OnSendComplete){ m_Callbacks.m_OnSendComplete(*this); }
+	if(bData && m_Callbacks.m_OnData){ m_Callbacks.m_OnData(*this); }
+	if(bClosed && m_Callbacks.m_OnClose){ m_Callbacks.m_OnClose(*this); }
+	return 0;
+}
+
+int RdtConnection::Poll(int timeoutMs)
+{
+	uint64_t deadline = m_pEventLoop->Timers().NextDeadline();
+	if(timeoutMs >= 0)
+	{
+		uint64_t wakeTime = RdtNow() + timeoutMs * RDT_NS_PER_MS;
+		if(deadline == 0 || wakeTime < deadline)
+		{
+			deadline = wakeTime;
+		}
+	}
+
+	if(m_pEventLoop->Wait(deadline) == -1)
+	{
+		return -1;
+	}
+
+	return Process();
+}
+
 int RdtConnection::Connect(const sockaddr *address, socklen_t address_len)
 {
-	m_pAddr = (sockaddr*)address;
+	m_LocalAddr = *address;
+	m_pAddr = &m_LocalAddr;
 	m_AddrLen = address_len;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Connections[PeerKey(m_LocalAddr)] = this;
+	}
 
 	// Send SYN
-	RdtPacket *pSyn = new RdtPacket;
-	pSyn->hdr.m_SeqNumber = rand() % RDT_MAX_SEQNUM;
-	pSyn->hdr.m_Reserved = 0;
+	RdtPacket *pSyn = AllocPacket();
+	if(!pSyn)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Connections.erase(PeerKey(m_LocalAddr));
+		m_pAddr = nullptr;
+		return -1;
+	}
+	pSyn->hdr.m_SeqNumber = RandomSeq();
+	pSyn->hdr.m_Timestamp = 0;
 	pSyn->hdr.m_Flags = RdtHeader::FLAG_SYN;
 	pSyn->hdr.m_MsgLen = sizeof(RdtHeader);
 	Send(pSyn, false, true);
+	m_bConnected = false;
+
+	// Process() reports the SYN-ACK instead
+	if(m_bNonBlocking)
+	{
+		FlushAndArm();
+		errno = EINPROGRESS;
+		return -1;
+	}
 
 	// Wait for SYN-ACK (ACK will be sent by Update())
 	int result;
@@ -105,11 +472,15 @@ int RdtConnection::Connect(const sockaddr *address, socklen_t address_len)
 	{
 		if(result == -1)
 		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Connections.erase(PeerKey(m_LocalAddr));
 			m_pAddr = nullptr;
 			return -1;
 		}
 	}
 
+	m_bConnected = true;
+	TraceConnect();
 	return 0;
 }
 
@@ -122,9 +493,13 @@ int RdtConnection::SendRequest(std::string filename)
 	}
 
 	// Send RQST packet
-	RdtPacket *pRequest = new RdtPacket;
+	RdtPacket *pRequest = AllocPacket();
+	if(!pRequest)
+	{
+		return -1;
+	}
 	pRequest->hdr.m_SeqNumber = m_NextSeq;
-	pRequest->hdr.m_Reserved = 0;
+	pRequest->hdr.m_Timestamp = 0;
 	pRequest->hdr.m_Flags = RdtHeader::FLAG_RQST;
 	pRequest->hdr.m_MsgLen = filename.length() + sizeof(RdtHeader) + 1;
 
@@ -141,81 +516,150 @@ int RdtConnection::SendRequest(std::string filename)
 
 int RdtConnection::RecvFile(std::string outputFile)
 {
-	std::ofstream outFile(outputFile, std::ios::out
-						  | std::ios::trunc | std::ios::binary);
-	if(!outFile)
+	int fd = open(outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd == -1)
 	{
 		return -1;
 	}
 
-	RdtPacket pkt;
-	std::string pktStr;
-	std::unordered_map<uint16_t,std::string> seqToStr;
-	uint16_t expectedSeq;
-	bool bReceivedFirst = false;
-	bool bReceivedLast = false;
-	uint16_t lastSeq;
-	while(1)
+	// Write out the file's data as it comes in order, up to its last packet.
+	// Through io_uring, it is written in the background while more comes in.
+	RdtUring &uring = m_pListener->m_Uring;
+	RdtUringWrite fileWrite = {};
+	fileWrite.m_pLoop = m_pEventLoop;
+
+	int result = 0;
+	bool bEnd = false;
+	while(!bEnd)
 	{
-		if(Update(&pkt) == EUR_DATA)
+		int flushed = uring.IsActive() ?
+			m_Reassembly.FlushAsync(uring, &fileWrite, fd, &bEnd) :
+			m_Reassembly.Flush(fd, &bEnd);
+		if(flushed == -1)
 		{
-			pktStr = std::string(&(pkt.msg[sizeof(RdtHeader)]), pkt.hdr.m_MsgLen - sizeof(RdtHeader));
-
-			if(!bReceivedFirst && pkt.hdr.m_Flags & RdtHeader::FLAG_FIRST)
-			{
-				bReceivedFirst = true;
-				expectedSeq = (pkt.hdr.m_SeqNumber + pkt.hdr.m_MsgLen) % RDT_MAX_SEQNUM;
-				outFile.write(&pktStr[0], pktStr.length());
-
-				if(pkt.hdr.m_Flags & RdtHeader::FLAG_LAST)
-				{
-					goto close;
-				}
-			}
-			else if(bReceivedFirst && pkt.hdr.m_SeqNumber == expectedSeq)
-			{
-				expectedSeq = (expectedSeq + pkt.hdr.m_MsgLen) % RDT_MAX_SEQNUM;
-				outFile.write(&pktStr[0], pktStr.length());
+			result = -1;
+			break;
+		}
 
-				if(pkt.hdr.m_Flags & RdtHeader::FLAG_LAST)
-				{
-					goto close;
-				}
+		UpdateWindow();
+		if(bEnd)
+		{
+			break;
+		}
 
-				std::unordered_map<uint16_t,std::string>::iterator iter;
-				while((iter = seqToStr.find(expectedSeq)) != seqToStr.end())
-				{
-					outFile.write(&iter->second[0], iter->second.length());
-					if(bReceivedLast && expectedSeq == lastSeq)
-					{
-						goto close;
-					}
+		// The peer closed before sending the whole file
+		if(m_ReceivedFIN && !m_Reassembly.HasData())
+		{
+			result = -1;
+			break;
+		}
 
-					expectedSeq = (expectedSeq + iter->second.length()
-								   + sizeof(RdtHeader)) % RDT_MAX_SEQNUM;
-					seqToStr.erase(iter);
-				}
-			}
-			else
-			{
-				// Only store out-of-order packets that are within the window
-				if(!bReceivedLast && pkt.hdr.m_Flags & RdtHeader::FLAG_LAST)
-				{
-					bReceivedLast = true;
-					lastSeq = pkt.hdr.m_SeqNumber;
-				}
-				seqToStr[pkt.hdr.m_SeqNumber] = pktStr;
-			}
+		if(Update() == -1)
+		{
+			result = -1;
+			break;
 		}
 	}
 
-close:
-	outFile.close();
-	return 0;
+	if(fileWrite.m_bPending)
+	{
+		uring.Reap(&fileWrite, true);
+	}
+
+	SendPendingAck();
+	close(fd);
+	return result;
+}
+
+ssize_t RdtConnection::Write(const void *pData, size_t len)
+{
+	iovec iov = {const_cast<void*>(pData), len};
+	return SendData(&iov, 1, false);
+}
+
+ssize_t RdtConnection::Writev(const iovec *pIov, int count)
+{
+	return SendData(pIov, count, false);
+}
+
+ssize_t RdtConnection::SendMessage(const void *pData, size_t len)
+{
+	iovec iov = {const_cast<void*>(pData), len};
+	return SendData(&iov, 1, true);
+}
+
+ssize_t RdtConnection::SendMessagev(const iovec *pIov, int count)
+{
+	return SendData(pIov, count, true);
+}
+
+ssize_t RdtConnection::Read(void *pBuf, size_t len)
+{
+	iovec iov = {pBuf, len};
+	return RecvData(&iov, 1, false);
+}
+
+ssize_t RdtConnection::Readv(const iovec *pIov, int count)
+{
+	return RecvData(pIov, count, false);
+}
+
+ssize_t RdtConnection::RecvMessage(void *pBuf, size_t len)
+{
+	iovec iov = {pBuf, len};
+	return RecvData(&iov, 1, true);
+}
+
+ssize_t RdtConnection::RecvMessagev(const iovec *pIov, int count)
+{
+	return RecvData(pIov, count, true);
+}
+
+ssize_t RdtConnection::WriteStream(uint32_t stream, const void *pData, size_t len)
+{
+	iovec iov = {const_cast<void*>(pData), len};
+	return SendData(&iov, 1, false, stream);
+}
+
+ssize_t RdtConnection::SendStreamMessage(uint32_t stream, const void *pData, size_t len)
+{
+	iovec iov = {const_cast<void*>(pData), len};
+	return SendData(&iov, 1, true, stream);
+}
+
+ssize_t RdtConnection::ReadStream(uint32_t stream, void *pBuf, size_t len)
+{
+	iovec iov = {pBuf, len};
+	return RecvData(&iov, 1, false, stream);
+}
+
+ssize_t RdtConnection::RecvStreamMessage(uint32_t stream, void *pBuf, size_t len)
+{
+	iovec iov = {pBuf, len};
+	return RecvData(&iov, 1, true, stream);
+}
+
+std::vector<uint32_t> RdtConnection::ReadableStreams() const
+{
+	std::vector<uint32_t> streams;
+	m_Reassembly.GetReadyStreams(streams);
+	return streams;
 }
 
 int RdtConnection::WaitAndClose()
 {
+	// Once the peer's FIN is in, closing is the same as Close()
+	if(m_bNonBlocking)
+	{
+		if(!m_ReceivedFIN)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
+		return Close();
+	}
+
 	// Wait for FIN
 	int result;
 	while(!m_ReceivedFIN)
@@ -226,13 +670,10 @@ int RdtConnection::WaitAndClose()
 		}
 	}
 
-	// Send FIN
-	RdtPacket *pFin = new RdtPacket;
-	pFin->hdr.m_SeqNumber = m_NextSeq;
-	pFin->hdr.m_Reserved = 0;
-	pFin->hdr.m_Flags = RdtHeader::FLAG_FIN;
-	pFin->hdr.m_MsgLen = sizeof(RdtHeader);
-	Send(pFin);
+	if(WaitForAcks() == -1 || SendFin() == -1)
+	{
+		return -1;
+	}
 
 	// Wait for FIN-ACK
 	while((result = Update()) != EUR_FINACK)
@@ -252,7 +693,51 @@ int RdtConnection::Bind(const sockaddr *address, socklen_t address_len)
 	return ::bind(m_UdpSocket, address, address_len);
 }
 
-int RdtConnection::Listen(int backlog)
+int RdtConnection::SetReusePort(bool bEnable)
+{
+	int value = bEnable;
+	if(setsockopt(m_UdpSocket, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) == -1)
+	{
+		ERROR(ERR_SOCKOPT, false);
+		return -1;
+	}
+
+	return 0;
+}
+
+int RdtConnection::SetCpuSteering(const std::vector<int> &cpus)
+{
+	if(cpus.empty())
+	{
+		return -1;
+	}
+
+	// The program returns the index of the socket to use: i if the CPU is
+	// cpus[i], otherwise the CPU modulo the group size
+	std::vector<sock_filter> code;
+	code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
+	for(size_t i = 0; i < cpus.size(); ++i)
+	{
+		code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1));
+		code.push_back(BPF_STMT(BPF_RET | BPF_K, (uint32_t)i));
+	}
+	code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)cpus.size()));
+	code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+
+	sock_fprog prog;
+	prog.len = (unsigned short)code.size();
+	prog.filter = code.data();
+	if(code.size() > BPF_MAXINSNS ||
+		setsockopt(m_UdpSocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+	{
+		ERROR(ERR_SOCKOPT, false);
+		return -1;
+	}
+
+	return 0;
+}
+
+int RdtConnection::Listen(int backlog)
 {
 	if(backlog < 1)
 	{
@@ -272,24 +757,94 @@ int RdtConnection::Accept(sockaddr *address, socklen_t address_len)
 {
 	if(m_pAddr != nullptr){ return -1; }
 
+	return _Accept(*this, address, address_len);
+}
+
+int RdtConnection::Accept(RdtConnection &conn, sockaddr *address, socklen_t address_len)
+{
+	if(!m_IsListener || &conn == this || conn.m_UdpSocket != -1){ return -1; }
+
+	conn.m_pListener = this;
+	conn.m_UdpSocket = m_UdpSocket;
+	conn.m_ReceivedFIN = false;
+	if(conn._Init() == -1)
+	{
+		conn.m_pListener = &conn;
+		conn.m_UdpSocket = -1;
+		return -1;
+	}
+
+	if(_Accept(conn, address, address_len) == -1)
+	{
+		// Let the connection be accepted into again, non-blocking or not
+		int error = errno;
+		conn.m_pEventLoop->Remove(conn.WatchedFd());
+		conn.m_pListener = &conn;
+		conn.m_UdpSocket = -1;
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+int RdtConnection::_Accept(RdtConnection &conn, sockaddr *address, socklen_t address_len)
+{
+	// Wait for a pending connection from a peer that isn't already connected
+	// (retransmitted SYNs may have queued the same peer more than once)
 	PendingConnection pending;
-	while(!m_PendingConnections.Pop(&pending))
+	while(1)
 	{
-		Update();
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			if(m_PendingConnections.Pop(&pending))
+			{
+				PeerKey key(pending.addr);
+				if(m_Connections.find(key) == m_Connections.end())
+				{
+					// Register connection in the table
+					conn.m_LocalAddr = pending.addr;
+					conn.m_pAddr = &conn.m_LocalAddr;
+					conn.m_AddrLen = sizeof(sockaddr_in);
+					m_Connections[key] = &conn;
+					break;
+				}
+				continue;
+			}
+		}
+
+		if(m_bNonBlocking)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if(Update() == -1)
+		{
+			return -1;
+		}
 	}
 
-	// Create new connection
-	m_LocalAddr = pending.addr;
-	m_pAddr = &m_LocalAddr;
-	m_AddrLen = sizeof(sockaddr_in);
+	if(address)
+	{
+		memcpy(address, &pending.addr, std::min((size_t)address_len, sizeof(sockaddr)));
+	}
 
 	// Send synack
-	RdtPacket *pSyn = new RdtPacket;
-	pSyn->hdr.m_SeqNumber = rand() % RDT_MAX_SEQNUM;
-	pSyn->hdr.m_Reserved = 0;
+	RdtPacket *pSyn = conn.AllocPacket();
+	if(!pSyn)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Connections.erase(PeerKey(pending.addr));
+		return -1;
+	}
+	pSyn->hdr.m_SeqNumber = RandomSeq();
+	pSyn->hdr.m_Timestamp = 0;
 	pSyn->hdr.m_Flags = RdtHeader::FLAG_SYN | RdtHeader::FLAG_ACK;
 	pSyn->hdr.m_MsgLen = sizeof(RdtHeader);
-	Send(pSyn);
+	conn.Send(pSyn);
+	conn.FlushAndArm();
+	conn.TraceConnect();
 
 	return 0;
 }
@@ -313,477 +868,1498 @@ int RdtConnection::RecvRequest(std::string &filename)
 
 int RdtConnection::SendFile(std::string filename)
 {
-	std::ifstream inFile(filename, std::ios::binary | std::ios::ate);
+	// Data written before the file goes out ahead of it
+	if(DrainSendQueue() == -1)
+	{
+		return -1;
+	}
 
-	if(inFile)
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
 	{
-		// Get file length
-		std::streamoff len = inFile.tellg();
-		inFile.seekg(0, std::ios::beg);
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return -1;
+	}
 
-		// While info left, send packets until window fills, then update
-		bool bFirst = true;
-		do
+	// Map the file so packets can reference their payload in place, rather
+	// than each holding a copy. If it can't be mapped, read it into packets.
+	size_t len = st.st_size;
+	const char *pMap = nullptr;
+	if(len > 0)
+	{
+		void *pAddr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+		if(pAddr != MAP_FAILED)
 		{
-			int msgLen = std::min((std::streamoff)RDT_MSS, len);
-			len -= msgLen;
+			madvise(pAddr, len, MADV_SEQUENTIAL);
+			pMap = static_cast<const char*>(pAddr);
+		}
+	}
 
-			// Create packet
-			RdtPacket *pPkt = new RdtPacket;
-			pPkt->hdr.m_SeqNumber = m_NextSeq;
-			pPkt->hdr.m_Reserved = 0;
-			pPkt->hdr.m_Flags = 0;
-			if(bFirst)
-			{
-				pPkt->hdr.m_Flags = RdtHeader::FLAG_FIRST;
-				bFirst = false;
-			}
+	// While info left, send packets until window fills, then update
+	int result = 0;
+	size_t offset = 0;
+	do
+	{
+		size_t msgLen = std::min((size_t)RDT_MSS, len - offset);
 
-			if(len == 0)
-			{
-				pPkt->hdr.m_Flags |= RdtHeader::FLAG_LAST;
-			}
-			pPkt->hdr.m_MsgLen = msgLen + sizeof(RdtHeader);
-			inFile.read(&(pPkt->msg[sizeof(RdtHeader)]), msgLen);
-			//std::cerr.write(&(pPkt->msg[sizeof(RdtHeader)]), msgLen);
+		// Create packet, which only needs room for the header if mapped
+		RdtPacket *pPkt = pMap ? m_HeaderPool.Alloc() : AllocPacket();
+		if(!pPkt)
+		{
+			result = -1;
+			break;
+		}
 
-			// Spin until we have room to send another packet
-			uint16_t nextSeq = m_NextSeq;
-			if(m_NextSeq < m_MinUnacked)
-			{
-				nextSeq += RDT_MAX_SEQNUM;
-			}
-			while(nextSeq + pPkt->hdr.m_MsgLen - m_MinUnacked > m_WndSize ||
-				  m_UnackedPackets.IsFull())
-			{
-				Update();
-				nextSeq = m_NextSeq;
-				if(m_NextSeq < m_MinUnacked)
-				{
-					nextSeq += RDT_MAX_SEQNUM;
-				}
-			}
+		if(!pMap && pread(fd, &pPkt->msg[sizeof(RdtHeader)], msgLen, offset) != (ssize_t)msgLen)
+		{
+			m_pPool->Free(pPkt);
+			result = -1;
+			break;
+		}
 
-			Send(pPkt);
-		} while(len != 0);
+		// Only the connection's very first data packet is marked FIRST, so
+		// that the receiver can't mistake a later file for where data starts
+		pPkt->hdr.m_SeqNumber = m_NextSeq;
+		pPkt->hdr.m_Timestamp = 0;
+		pPkt->hdr.m_Flags = 0;
+		if(!m_bSendSynced)
+		{
+			pPkt->hdr.m_Flags = RdtHeader::FLAG_FIRST;
+		}
 
-		inFile.close();
+		if(offset + msgLen == len)
+		{
+			pPkt->hdr.m_Flags |= RdtHeader::FLAG_LAST;
+		}
+		pPkt->hdr.m_MsgLen = msgLen + sizeof(RdtHeader);
 
-		// Spin until no more unacked packets
-		while(m_UnackedPackets.Size() > 0)
+		// Spin until we have room to send another packet
+		while(!CanSend(pPkt->hdr.SeqSpace()))
 		{
 			Update();
 		}
 
-		return 0;
-	}
-
-	return -1;
-}
-
-int RdtConnection::Close()
-{
-	// Send FIN
-	RdtPacket *pFin = new RdtPacket;
-	pFin->hdr.m_SeqNumber = m_NextSeq;
-	pFin->hdr.m_Reserved = 0;
-	pFin->hdr.m_Flags = RdtHeader::FLAG_FIN;
-	pFin->hdr.m_MsgLen = sizeof(RdtHeader);
-	Send(pFin);
+		Send(pPkt, false, false, pMap ? pMap + offset : nullptr);
+		m_bSendSynced = true;
+		offset += msgLen;
+	} while(offset < len);
 
-	// Wait for FIN-ACK and FIN
-	bool bFin = false, bFinAck = false;
-	int result;
-	while(!bFin || !bFinAck)
+	// Spin until no more unacked packets, which may still reference the map
+	if(result == 0)
 	{
-		result = Update();
-
-		switch(result)
-		{
-		case -1:
-			return -1;
-		case EUR_FIN:
-			bFin = true;
-			break;
-		case EUR_FINACK:
-			bFinAck = true;
-			break;
-		default:
-			break;
-		}
+		result = WaitForAcks();
 	}
 
-	// Wait for amount of time then close
-	clock_t finishTime = clock() + MULT<RDT_RTO_CLK, 2>::val;
-	do
+	if(result == -1)
 	{
-		if(Update() == -1)
-		{
-			return -1;
-		}
-	} while(clock() < finishTime);
+		ClearUnacked();
+	}
 
-	Shutdown();
-	return 0;
+	// Resends of mapped packets may still be queued
+	Flush();
+	if(pMap)
+	{
+		munmap(const_cast<char*>(pMap), len);
+	}
+	close(fd);
+	return result;
 }
 
-int RdtConnection::Update(RdtPacket *pPkt)
+ssize_t RdtConnection::SendData(const iovec *pIov, int count, bool bMessage, int64_t stream)
 {
-	// Resend as needed
-	static clock_t currClock;
-	currClock = clock();
-	Resend(currClock);
-
-	// Select w/timeout
-	fd_set fds_read = m_fdsMain;
-	int result;
-	timeval tv;
-	tv.tv_sec = 0;
-	// TODO - although this should work anyways
-	tv.tv_usec = 0;
-	if((result = select(m_UdpSocket+1, &fds_read, NULL, NULL, &tv)) == -1)
+	size_t len = 0;
+	for(int i = 0; i < count; ++i)
 	{
-		ERROR(ERR_SELECT, false);
+		len += pIov[i].iov_len;
 	}
-	else if(result == 0)
+
+	// An empty message still takes a packet to mark where it ends
+	if(len == 0 && !bMessage)
 	{
-		// Resend as needed
-		currClock = clock();
-		Resend(currClock);
+		return 0;
 	}
-	else
-	{
-		// Read from the udp socket
-		RdtPacket localPkt;
-		if(!pPkt){ pPkt = &localPkt; }
 
-		sockaddr addr;
-		if(!Recv(*pPkt, &addr)){ ERROR(ERR_RECV, false); return -1; }
+	// Without blocking, a message is queued whole or not at all
+	size_t mss = (stream < 0) ? RDT_MSS : RDT_STREAM_MSS;
+	size_t packets = std::max((len + mss - 1) / mss, (size_t)1);
+	if(m_bNonBlocking && bMessage && packets > RDT_SEND_QUEUE - m_SendQueue.Size())
+	{
+		m_bWriteBlocked = packets <= RDT_SEND_QUEUE;
+		errno = m_bWriteBlocked ? EAGAIN : EMSGSIZE;
+		return -1;
+	}
 
-		// If SYN, handle only if listener
-		if(pPkt->hdr.m_Flags == RdtHeader::FLAG_SYN)
+	int iov = 0;
+	size_t iovOffset = 0;
+	size_t offset = 0;
+	size_t queued = 0;
+	do
+	{
+		// Wait for room in the queue, or without blocking, stop at its end
+		while(m_SendQueue.IsFull() && !m_bNonBlocking)
 		{
-			if(m_IsListener)
+			if(Update() == -1)
 			{
-				PendingConnection pending;
-				pending.addr = addr;
-				pending.seqNum = pPkt->hdr.m_SeqNumber;
-				m_PendingConnections.Push(pending); // Ignore if no room
-				return EUR_SYN;
+				return -1;
 			}
-			return EUR_DROPPED;
+			SendQueued();
 		}
-		// Only accept packets from the currently connected client
-		else if(!m_pAddr || memcmp(&addr, m_pAddr, sizeof(sockaddr)) != 0)
+
+		RdtPacket *pPkt = m_SendQueue.IsFull() ? nullptr : AllocPacket();
+		if(!pPkt && !m_bNonBlocking)
 		{
-			std::cerr << "Dropping packet!\n";
-			return EUR_DROPPED;
+			return -1;
 		}
-		// If SYNACK
-		else if(pPkt->hdr.m_Flags == (RdtHeader::FLAG_ACK | RdtHeader::FLAG_SYN))
+		else if(!pPkt)
 		{
-			if(m_SynIndex != -1)
+			// A shared pool ran out partway through the message
+			while(bMessage && queued > 0 && m_SendQueue.PopBack(&pPkt))
 			{
-				Ack(m_UnackedPackets[m_SynIndex]);
-				m_SynIndex = -1;
+				m_pPool->Free(pPkt);
+				--queued;
 			}
+			break;
+		}
 
-			// Send ACK
-			RdtPacket ack = *pPkt;
-			ack.hdr.m_Flags = RdtHeader::FLAG_ACK;
-			ack.hdr.m_MsgLen = sizeof(RdtHeader);
-			ack.hdr.m_Reserved = 0;
-			Send(&ack);
+		size_t msgLen = std::min(mss, len - offset);
 
-			return EUR_SYNACK;
-		}
-		// If ACK, find in unacked buffer & change m_WndCurr
-		else if(pPkt->hdr.m_Flags & RdtHeader::FLAG_ACK)
+		// SendQueued() links stream packets to the previous one once their
+		// sequence numbers are known
+		char *pPayload = &pPkt->msg[sizeof(RdtHeader)];
+		pPkt->hdr.m_Flags = 0;
+		if(stream >= 0)
 		{
-			auto iter = m_SeqToIndex.find(pPkt->hdr.m_SeqNumber);
-			if(iter != m_SeqToIndex.end())
-			{
-				Ack(m_UnackedPackets[iter->second]);
-				m_SeqToIndex.erase(iter);
-			}
+			RdtStreamHeader streamHdr;
+			streamHdr.m_Stream = (uint32_t)stream;
+			streamHdr.m_PrevDist = 0;
+			streamHdr.hton();
+			memcpy(pPayload, &streamHdr, sizeof(streamHdr));
+			pPayload += sizeof(streamHdr);
+			pPkt->hdr.m_Flags = RdtHeader::FLAG_STREAM;
+		}
 
-			if(pPkt->hdr.m_Flags & RdtHeader::FLAG_FIN)
+		// Gather the payload from however many buffers it spans
+		for(size_t copied = 0; copied < msgLen;)
+		{
+			size_t part = std::min(msgLen - copied, pIov[iov].iov_len - iovOffset);
+			memcpy(pPayload + copied, static_cast<const char*>(pIov[iov].iov_base) + iovOffset, part);
+			copied += part;
+			iovOffset += part;
+			if(iovOffset == pIov[iov].iov_len)
 			{
-				return EUR_FINACK;
+				++iov;
+				iovOffset = 0;
 			}
-			return EUR_ACK;
 		}
-		// Else if FIN, handle
-		else if(pPkt->hdr.m_Flags == RdtHeader::FLAG_FIN)
+
+		// The receiver learns where messages end from the LAST flag.
+		// SendQueued() numbers the packet and marks our very first one.
+		pPkt->hdr.m_Timestamp = 0;
+		if(bMessage && offset + msgLen == len)
 		{
-			m_ReceivedFIN = true;
+			pPkt->hdr.m_Flags |= RdtHeader::FLAG_LAST;
+		}
+		pPkt->hdr.m_MsgLen = (pPayload - pPkt->msg) + msgLen;
 
-			// Send FINACK (don't new the finack!)
-			pPkt->hdr.m_MsgLen = sizeof(RdtHeader);
-			pPkt->hdr.m_Reserved = 0;
-			pPkt->hdr.m_Flags = RdtHeader::FLAG_ACK | RdtHeader::FLAG_FIN;
-			Send(pPkt);
-			return EUR_FIN;
+		m_SendQueue.Push(pPkt);
+		++queued;
+		offset += msgLen;
+
+		// A message being queued without blocking may still be taken back
+		if(!m_bNonBlocking)
+		{
+			SendQueued();
 		}
-		// Else, store packet message and send ACK
-		else
+	} while(offset < len);
+
+	// Without blocking, whatever didn't fit waits for m_OnWritable
+	if(offset < len || queued == 0)
+	{
+		m_bWriteBlocked = true;
+	}
+
+	if(queued == 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	m_bSendPending = true;
+	if(!m_bNonBlocking && DrainSendQueue() == -1)
+	{
+		return -1;
+	}
+
+	// Packets hold their own copy, so the caller's buffers are free again
+	SendQueued();
+	FlushAndArm();
+	return offset;
+}
+
+ssize_t RdtConnection::RecvData(const iovec *pIov, int count, bool bMessage, int64_t stream)
+{
+	// Work on a copy of the buffers that is advanced past what was read
+	std::vector<iovec> iov(pIov, pIov + count);
+	int first = AdvanceIov(iov.data(), count, 0, 0);
+	if(first == count && !bMessage)
+	{
+		return 0;
+	}
+
+	// Without blocking, a message is only read once all of it is in, which
+	// it never will be if it can't fit in the receive window
+	bool bHasMessage = (stream < 0) ? m_Reassembly.HasMessage() :
+		m_Reassembly.HasStreamMessage((uint32_t)stream);
+	if(m_bNonBlocking && bMessage && !bHasMessage && !m_ReceivedFIN)
+	{
+		errno = (m_bRecvSynced && m_Reassembly.Space() == 0) ? EMSGSIZE : EAGAIN;
+		return -1;
+	}
+
+	size_t total = 0;
+	while(true)
+	{
+		// Wait for data; the peer only closes once all it sent has arrived
+		while((stream < 0) ? !m_Reassembly.HasData() :
+			  !m_Reassembly.HasStreamData((uint32_t)stream))
 		{
-			// Send ACK
-			RdtPacket ack = *pPkt;
-			ack.hdr.m_Flags = RdtHeader::FLAG_ACK;
-			ack.hdr.m_MsgLen = sizeof(RdtHeader);
-			ack.hdr.m_Reserved = 0;
-			Send(&ack);
+			if(m_ReceivedFIN)
+			{
+				return total;
+			}
 
-			if(pPkt->hdr.m_Flags & RdtHeader::FLAG_RQST)
+			if(m_bNonBlocking)
 			{
-				return EUR_RQST;
+				errno = EAGAIN;
+				return -1;
 			}
-			else
+
+			if(Update() == -1)
 			{
-				// Remove expired elements from received list
-				bool bAlreadyExists = false;
-				for(auto iter = m_ReceivedList.begin(); iter != m_ReceivedList.end();)
-				{
-					if(*iter == pPkt->hdr.m_SeqNumber)
-					{
-						bAlreadyExists = true;
-					}
+				return -1;
+			}
+		}
 
-					auto diff = std::abs(*iter - pPkt->hdr.m_SeqNumber);
-					if(RDT_WNDSIZE < diff && diff < RDT_MAX_SEQNUM - RDT_WNDSIZE)
-					{
-						iter = m_ReceivedList.erase(iter);
-					}
-					else
-					{
-						++iter;
-					}
-				}
+		// Whatever of a message doesn't fit in the buffers is discarded
+		bool bEnd;
+		char discard[RDT_MSS];
+		iovec rest = {discard, sizeof(discard)};
+		const iovec *pDest = (first < count) ? &iov[first] : &rest;
+		int destCount = (first < count) ? count - first : 1;
+		bool bDestMessage = bMessage || first == count;
+		size_t bytes = (stream < 0) ?
+			m_Reassembly.Read(pDest, destCount, bDestMessage, &bEnd) :
+			m_Reassembly.ReadStream((uint32_t)stream, pDest, destCount, bDestMessage, &bEnd);
+		if(first < count)
+		{
+			first = AdvanceIov(iov.data(), count, first, bytes);
+			total += bytes;
+		}
 
-				// Add current element to received list if needed
-				if(!bAlreadyExists)
-				{
-					m_ReceivedList.push_back(pPkt->hdr.m_SeqNumber);
-				}
-				else
-				{
-					return 0; // Only return EUR_DATA first time a pkt is received
-				}
+		UpdateWindow();
 
-				return EUR_DATA;
-			}
+		// A stream read returns whatever is in order; an empty message at
+		// the front is passed over rather than read as the end of the stream
+		if(bMessage ? bEnd : total > 0)
+		{
+			return total;
 		}
 	}
-
-	return 0;
 }
 
-void RdtConnection::Resend(clock_t currTime)
+int RdtConnection::AdvanceIov(iovec *pIov, int count, int first, size_t bytes)
 {
-	while(currTime >= m_EarliestTimeout && m_pEarliestPacket != nullptr)
+	while(first < count && (bytes > 0 || pIov[first].iov_len == 0))
 	{
-		// Resend packet
-		Send(m_pEarliestPacket->m_pPacket, true);
-		m_pEarliestPacket->m_ResendTime = clock() + RDT_RTO_CLK;
-
-		// Update linked list
-		if(m_pEarliestPacket != m_pLatestPacket)
+		size_t part = std::min(bytes, pIov[first].iov_len);
+		pIov[first].iov_base = static_cast<char*>(pIov[first].iov_base) + part;
+		pIov[first].iov_len -= part;
+		bytes -= part;
+		if(pIov[first].iov_len == 0)
 		{
-			m_pLatestPacket->m_pNext = m_pEarliestPacket;
-			m_pLatestPacket = m_pEarliestPacket;
-			m_pEarliestPacket = m_pEarliestPacket->m_pNext;
-			m_pLatestPacket->m_pNext = nullptr;
+			++first;
 		}
-
-		m_EarliestTimeout = m_pEarliestPacket->m_ResendTime;
 	}
+
+	return first;
 }
 
-bool RdtConnection::Send(RdtPacket *pPkt, bool isResend, bool isSyn)
+void RdtConnection::SendQueued()
 {
-	uint16_t len = pPkt->hdr.m_MsgLen;
-
-	if(!isResend && pPkt->hdr.m_Flags != RdtHeader::FLAG_ACK &&
-	   pPkt->hdr.m_Flags != (RdtHeader::FLAG_ACK | RdtHeader::FLAG_FIN))
+	RdtPacket **ppPkt;
+	while((ppPkt = m_SendQueue.Peek()) && CanSend((*ppPkt)->hdr.SeqSpace()))
 	{
-		// Create unacked packet
-		UnackedPacket unacked;
-		unacked.m_ResendTime = clock() + RDT_RTO_CLK;
-		unacked.m_pNext = nullptr;
-		unacked.m_pPacket = pPkt;
-
-		// Place into circular buffer
-		int index;
-		if(!m_UnackedPackets.Push(unacked, &index))
+		// The receiver learns where our data starts from the FIRST flag
+		RdtPacket *pPkt = *ppPkt;
+		m_SendQueue.Pop(nullptr);
+		pPkt->hdr.m_SeqNumber = m_NextSeq;
+		if(!m_bSendSynced)
 		{
-			assert(0);
-			return false;
+			pPkt->hdr.m_Flags |= RdtHeader::FLAG_FIRST;
 		}
 
-		m_pLatestPacket = m_UnackedPackets[index];
-		if(m_pEarliestPacket == nullptr)
-		{
-			m_pEarliestPacket = m_pLatestPacket;
-			m_EarliestTimeout = unacked.m_ResendTime;
-			m_MinUnacked = pPkt->hdr.m_SeqNumber;
-		}
-		else
+		if(pPkt->hdr.m_Flags & RdtHeader::FLAG_STREAM)
 		{
-			UnackedPacket *pTest = m_pEarliestPacket;
-			while(pTest->m_pNext != nullptr)
+			RdtStreamHeader *pStreamHdr = reinterpret_cast<RdtStreamHeader*>(&pPkt->msg[sizeof(RdtHeader)]);
+			uint32_t stream = ntohl(pStreamHdr->m_Stream);
+			std::unordered_map<uint32_t,uint32_t>::iterator it = m_StreamLastSeq.find(stream);
+			if(it != m_StreamLastSeq.end())
 			{
-				pTest = pTest->m_pNext;
+				pStreamHdr->m_PrevDist = htonl(SeqDist(it->second, m_NextSeq));
+				it->second = m_NextSeq;
+			}
+			else
+			{
+				m_StreamLastSeq[stream] = m_NextSeq;
 			}
-
-			pTest->m_pNext = m_pLatestPacket;
 		}
 
-		if(isSyn){ m_SynIndex = index; }
-		else{ m_SeqToIndex[pPkt->hdr.m_SeqNumber] = index; }
-
-		// Update variables
-		m_WndCurr += len;
-
-		/*len = (len < 1) ? 1u : len;*/
-		m_NextSeq = (pPkt->hdr.m_SeqNumber + len) % RDT_MAX_SEQNUM;
+		Send(pPkt);
+		m_bSendSynced = true;
 	}
 
-	pPkt->hdr.hton();
-
-	if(sendto(m_UdpSocket, pPkt->msg, len, 0, m_pAddr, m_AddrLen) == -1)
+	// Everything sent must have arrived before the FIN tells the peer there
+	// is no more to read
+	if(m_bClosing && !m_bFinSent && m_SendQueue.Size() == 0 && m_Unacked.Size() == 0)
 	{
-		pPkt->hdr.ntoh();
-		ERROR(ERR_SEND, false);
-		return false;
+		SendFin(); // Retried on the next call if the pool is exhausted
 	}
-
-	pPkt->hdr.ntoh();
-
-	// Print message
-#if defined(RDT_SERVER) && !defined(RDT_CLIENT)
-	std::cout << "Sending packet " << pPkt->hdr.m_SeqNumber << " " << m_WndSize;
-	if(isResend){ std::cout << " Retransmission"; }
-	if(pPkt->hdr.m_Flags & RdtHeader::FLAG_SYN){ std::cout << " SYN"; }
-	if(pPkt->hdr.m_Flags & RdtHeader::FLAG_FIN){ std::cout << " FIN"; }
-	std::cout << "\n";
-#elif !defined(RDT_SERVER) && defined(RDT_CLIENT)
-	std::cout << "Sending packet " << pPkt->hdr.m_SeqNumber;
-	if(isResend){ std::cout << " Retransmission"; }
-	if(pPkt->hdr.m_Flags & RdtHeader::FLAG_SYN){ std::cout << " SYN"; }
-	if(pPkt->hdr.m_Flags & RdtHeader::FLAG_FIN){ std::cout << " FIN"; }
-	std::cout << "\n";
-#else
-// Compiling for general case
-#endif
-
-	return true;
 }
 
-bool RdtConnection::Recv(RdtPacket &pkt, sockaddr *pAddr)
+int RdtConnection::DrainSendQueue()
 {
-	static socklen_t len = sizeof(sockaddr_in);
-	if(recvfrom(m_UdpSocket, pkt.msg, RDT_MAX_PKTSIZE, 0, pAddr, &len) == -1)
+	SendQueued();
+	while(m_SendQueue.Size() > 0)
 	{
-		ERROR(ERR_RECV, false);
-		return false;
+		if(Update() == -1)
+		{
+			return -1;
+		}
+		SendQueued();
 	}
 
-	pkt.hdr.ntoh();
+	return 0;
+}
 
-	// Print message
-	std::cout << "Receiving packet " << pkt.hdr.m_SeqNumber;
+int RdtConnection::WaitForAcks()
+{
+	if(DrainSendQueue() == -1)
+	{
+		return -1;
+	}
 
-	for(auto i : m_ReceivedList)
+	while(m_Unacked.Size() > 0)
 	{
-		if(i == pkt.hdr.m_SeqNumber)
+		if(Update() == -1)
 		{
-			std::cout << " Retransmission";
-			break;
+			return -1;
 		}
 	}
 
-	std::cout << "\n";
-
-	return true;
+	return 0;
 }
 
-void RdtConnection::Ack(UnackedPacket *pUnacked)
+int RdtConnection::SendFin()
 {
-	if(pUnacked->m_pPacket == nullptr)
+	RdtPacket *pFin = AllocPacket();
+	if(!pFin)
 	{
-		return;
+		return -1;
 	}
-
-	if(!m_pEarliestPacket)
+	pFin->hdr.m_SeqNumber = m_NextSeq;
+	pFin->hdr.m_Timestamp = 0;
+	pFin->hdr.m_Flags = RdtHeader::FLAG_FIN;
+	pFin->hdr.m_MsgLen = sizeof(RdtHeader);
+	Send(pFin);
+	m_bFinSent = true;
+	m_bClosedFirst = !m_ReceivedFIN;
+	return 0;
+}
+
+void RdtConnection::UpdateWindow()
+{
+	// Once reading has opened the window by half since we last advertised
+	// it, say so, as the sender may be stalled on the old one
+	uint32_t edge = m_Reassembly.ReadyEnd() + m_Reassembly.Space();
+	if(m_bRecvSynced && SeqDist(m_AdvertisedEdge, edge) >= m_RecvWnd / 2)
+	{
+		m_bAckPending = true;
+		SendPendingAck();
+	}
+}
+
+int RdtConnection::Close()
+{
+	// SendQueued() sends the FIN once everything before it is ACKed, and
+	// Process() reports the FINs having been exchanged
+	if(m_bNonBlocking)
 	{
-		goto clear;
+		m_bClosing = true;
+		SendQueued();
+		FlushAndArm();
+		return 0;
 	}
 
-	if(pUnacked == m_pEarliestPacket)
+	// Everything sent must have arrived before the FIN tells the peer there
+	// is no more to read
+	if(WaitForAcks() == -1 || SendFin() == -1)
+	{
+		return -1;
+	}
+
+	// Wait for FIN-ACK and FIN
+	bool bFin = false, bFinAck = false;
+	int result;
+	while(!bFin || !bFinAck)
 	{
-		if(pUnacked == m_pLatestPacket)
+		result = Update();
+
+		switch(result)
 		{
-			m_pEarliestPacket = m_pLatestPacket = nullptr;
+		case -1:
+			return -1;
+		case EUR_FIN:
+			// A peer in WaitAndClose() only sends its FIN once it has ours,
+			// and is gone once we ACK it, so its FIN-ACK may never be resent
+			bFin = true;
+			bFinAck = true;
+			break;
+		case EUR_FINACK:
+			bFinAck = true;
+			break;
+		default:
+			break;
 		}
-		else
+	}
+
+	// Wait for amount of time then close, long enough for the peer to resend
+	// its FIN even if its RTO is still the initial one
+	uint64_t finishTime = RdtNow() + 2 * std::max(m_Rtt.Rto(), RDT_RTO_MS * RDT_NS_PER_MS);
+	do
+	{
+		if(Update(nullptr, finishTime) == -1)
 		{
-			m_pEarliestPacket = m_pEarliestPacket->m_pNext;
+			return -1;
 		}
+	} while(RdtNow() < finishTime);
+
+	Shutdown();
+	return 0;
+}
+
+int RdtConnection::Update(RdtPacket *pPkt, uint64_t wakeTime)
+{
+	int result = Receive(pPkt);
+	if(result != EUR_EMPTY)
+	{
+		return result;
+	}
+	else if(m_bPaceDue)
+	{
+		// The pacer let our next packet out while we were busy
+		m_bPaceDue = false;
+		return 0;
+	}
+
+	// Sleep until a datagram arrives or the next resend is due
+	uint64_t deadline = m_pEventLoop->Timers().NextDeadline();
+	if(wakeTime != 0 && (deadline == 0 || wakeTime < deadline))
+	{
+		deadline = wakeTime;
 	}
+
+	// Failed sends were reported and will be resent like lost packets
+	Flush();
+	return (m_pEventLoop->Wait(deadline) == -1) ? -1 : 0;
+}
+
+int RdtConnection::Receive(RdtPacket *pPkt)
+{
+	// Resend as needed
+	Resend(RdtNow());
+
+	// Data is stored as it arrives, so an ACK sent once the batch has been
+	// taken in covers all of it
+	if(m_bAckNow || (m_AckDelay == 0 && m_bInboundDrained))
+	{
+		SendPendingAck();
+	}
+
+	// Read the next packet addressed to this connection, if any
+	RdtPacket localPkt;
+	if(!pPkt){ pPkt = &localPkt; }
+
+	int result = m_pListener->Demux(this, *pPkt);
+	if(result == EDR_EMPTY)
+	{
+		return EUR_EMPTY;
+	}
+	else if(result != EDR_PACKET)
+	{
+		return (result == EDR_ERROR) ? -1 : 0;
+	}
+
+	bool bCe = (pPkt->hdr.m_Flags & RdtHeader::FLAG_CE) != 0;
+	pPkt->hdr.m_Flags &= ~RdtHeader::FLAG_CE;
+
+	bool bDuplicate = IsDuplicate(pPkt->hdr);
+	RDT_TRACE(RTL_PACKET, bDuplicate ? RTE_RECV_DUP : RTE_RECV, m_TraceId, pPkt->hdr, bCe);
+
+	// A retransmitted SYN is already being answered by our SYNACK resends
+	if(pPkt->hdr.m_Flags == RdtHeader::FLAG_SYN)
+	{
+		return EUR_DROPPED;
+	}
+	// If SYNACK
+	else if(pPkt->hdr.m_Flags == (RdtHeader::FLAG_ACK | RdtHeader::FLAG_SYN))
+	{
+		if(m_SynIndex != -1)
+		{
+			Ack(m_SynIndex);
+			m_SynIndex = -1;
+		}
+
+		SendAck(pPkt->hdr);
+		return EUR_SYNACK;
+	}
+	// If ACK, find in unacked buffer & change m_WndCurr
+	else if(pPkt->hdr.m_Flags & RdtHeader::FLAG_ACK)
+	{
+		// The SYN is only ever ACKed by the SYNACK
+		int slot = m_Unacked.Find(pPkt->hdr.m_SeqNumber);
+		if(slot != -1 && slot != m_SynIndex)
+		{
+			// The ACK echoes the timestamp of the transmission it answers, so
+			// retransmitted packets still give unambiguous samples
+			uint64_t rtt = RdtTimestampAge(pPkt->hdr.m_Timestamp, RdtNow());
+			if(rtt < ((uint64_t)1 << (RDT_TS_SHIFT + 31)))
+			{
+				m_Rtt.Sample(rtt);
+			}
+			else
+			{
+				rtt = 0;
+			}
+
+			Ack(slot, rtt);
+		}
+
+		if(pPkt->hdr.m_MsgLen >= sizeof(RdtHeader) + sizeof(RdtAckInfo))
+		{
+			RdtAckInfo info;
+			memcpy(&info, &pPkt->msg[sizeof(RdtHeader)], sizeof(info));
+			info.ntoh();
+
+			// Track the receiver's flow-control window, ignoring reordered ACKs
+			if(!m_bPeerWndValid || !SeqBefore(info.m_CumAck, m_PeerCumAck))
+			{
+				m_PeerCumAck = info.m_CumAck;
+				m_PeerWnd = info.m_RecvWnd;
+				m_bPeerWndValid = true;
+			}
+
+			// Back off before the congestion the network reported causes loss
+			if((int32_t)(info.m_CeCount - m_PeerCeCount) > 0)
+			{
+				m_PeerCeCount = info.m_CeCount;
+				m_pCongestion->OnEcn(RdtNow(), m_WndCurr);
+				m_WndSize = m_pCongestion->Window();
+			}
+
+			// Everything before the cumulative ACK and within the ranges has
+			// arrived, even if the ACKs sent for it were lost
+			int front = m_Unacked.Front();
+			if(front != -1)
+			{
+				AckRange(m_Unacked.Seq(front), info.m_CumAck);
+			}
+
+			size_t count = (pPkt->hdr.m_MsgLen - sizeof(RdtHeader) - sizeof(RdtAckInfo)) /
+				sizeof(RdtSackBlock);
+			const char *pBlocks = &pPkt->msg[sizeof(RdtHeader) + sizeof(RdtAckInfo)];
+			for(size_t i = 0; i < std::min(count, (size_t)RDT_MAX_SACK_BLOCKS); ++i)
+			{
+				RdtSackBlock block;
+				memcpy(&block, pBlocks + i * sizeof(block), sizeof(block));
+				block.ntoh();
+				AckRange(block.m_Start, block.m_End);
+			}
+		}
+
+		uint64_t now = RdtNow();
+		DetectLosses(now);
+		ArmProbe(now);
+
+		if(pPkt->hdr.m_Flags & RdtHeader::FLAG_FIN)
+		{
+			return EUR_FINACK;
+		}
+		return EUR_ACK;
+	}
+	// Else if FIN, handle
+	else if(pPkt->hdr.m_Flags == RdtHeader::FLAG_FIN)
+	{
+		m_ReceivedFIN = true;
+
+		// Send FINACK (don't new the finack!)
+		pPkt->hdr.m_MsgLen = sizeof(RdtHeader);
+		pPkt->hdr.m_Flags = RdtHeader::FLAG_ACK | RdtHeader::FLAG_FIN;
+		Send(pPkt);
+		return EUR_FIN;
+	}
+	// Else, store packet message and send ACK
 	else
 	{
-		UnackedPacket *pTest = m_pEarliestPacket;
-		while(pTest->m_pNext != pUnacked)
+		if(pPkt->hdr.m_Flags & RdtHeader::FLAG_RQST)
+		{
+			SendAck(pPkt->hdr);
+			return EUR_RQST;
+		}
+
+		// Until the first data packet arrives there is no telling where
+		// other data belongs, so leave it for the sender to resend
+		if(!m_bRecvSynced)
+		{
+			if(!(pPkt->hdr.m_Flags & RdtHeader::FLAG_FIRST))
+			{
+				RDT_TRACE(RTL_EVENT, RTE_DROP, m_TraceId, pPkt->hdr, 0);
+				return EUR_DROPPED;
+			}
+
+			m_Reassembly.Initialize(m_RecvWnd);
+			m_Reassembly.Reset(pPkt->hdr.m_SeqNumber);
+			m_AdvertisedEdge = m_Reassembly.ReadyEnd() + m_Reassembly.Space();
+			m_bRecvSynced = true;
+		}
+
+		// Data is stored as it arrives and ACKed together with the packets
+		// around it. Gaps, their repair and lost ACKs are reported straight
+		// away, and so is the end of a message, since the sender may have
+		// nothing left to send until it hears.
+		bool bInOrder = pPkt->hdr.m_SeqNumber == m_Reassembly.ReadyEnd() &&
+			!m_Reassembly.HasGaps();
+
+		// Drop data past our receive window without ACKing it; the sender
+		// will resend it once the window has moved on
+		if(m_Reassembly.Insert(*pPkt) == RdtReassemblyBuffer::EIR_REJECTED)
+		{
+			RDT_TRACE(RTL_EVENT, RTE_DROP, m_TraceId, pPkt->hdr, m_Reassembly.Space());
+			return EUR_DROPPED;
+		}
+
+		if(!m_bAckPending && m_AckDelay != 0)
 		{
-			pTest = pTest->m_pNext;
+			m_pEventLoop->Timers().Schedule(&m_AckTimer, RdtNow() + m_AckDelay);
 		}
 
-		pTest->m_pNext = pUnacked->m_pNext;
+		m_AckHdr = pPkt->hdr;
+		m_bAckPending = true;
+		if(bCe){ ++m_CeCount; }
+		if(++m_AckCount >= m_AckEvery || !bInOrder || bDuplicate || bCe ||
+		   (pPkt->hdr.m_Flags & RdtHeader::FLAG_LAST))
+		{
+			m_bAckNow = true;
+		}
 
-		if(pUnacked == m_pLatestPacket)
+		if(bDuplicate)
 		{
-			m_pLatestPacket = pTest;
+			return 0; // Already received, the ACK must have been lost
 		}
+
+		return EUR_DATA;
 	}
 
-	m_WndCurr -= pUnacked->m_pPacket->hdr.m_MsgLen;
-	delete pUnacked->m_pPacket;
-	pUnacked->m_pPacket = nullptr;
+	return 0;
+}
+
+int RdtConnection::Demux(RdtConnection *pConn, RdtPacket &pkt)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	// Packets that another connection already routed to us come first
+	if(pConn->m_Inbound.Pop(&pkt))
+	{
+		pConn->m_bInboundDrained = (pConn->m_Inbound.Size() == 0);
+		return EDR_PACKET;
+	}
 
-clear:
-	if(pUnacked == m_UnackedPackets.Peek())
+	int count = Recv();
+	if(count == -1)
 	{
-		while((pUnacked = m_UnackedPackets.Peek()) &&
-			  pUnacked->m_pPacket == nullptr)
+		ERROR(ERR_RECV, false);
+		return EDR_ERROR;
+	}
+
+	// Route the whole batch, including our own packets, through the queues
+	for(int i = 0; i < count; ++i)
+	{
+		msghdr &hdr = m_pRecvBatch->m_pMsgs[i].msg_hdr;
+		const char *pData = static_cast<const char*>(m_pRecvBatch->Iov(i)[0].iov_base);
+		size_t len = m_pRecvBatch->m_pMsgs[i].msg_len;
+
+		// GRO aggregates hold several datagrams of segSize bytes each, only
+		// the last of which may be shorter
+		size_t segSize = GroSegmentSize(hdr, len);
+		bool bCe = IsCeMarked(hdr);
+		for(size_t offset = 0; offset < len; offset += segSize)
 		{
-			m_UnackedPackets.Pop(nullptr);
+			// Runts, and datagrams claiming more than arrived, would hand
+			// on bytes that were never received
+			size_t segLen = std::min(std::min(segSize, len - offset), (size_t)RDT_MAX_PKTSIZE);
+			if(segLen < sizeof(RdtHeader))
+			{
+				continue;
+			}
+
+			RdtPacket rcvd;
+			memcpy(rcvd.msg, pData + offset, segLen);
+			rcvd.hdr.ntoh();
+			if(rcvd.hdr.m_MsgLen < sizeof(RdtHeader) || rcvd.hdr.m_MsgLen > segLen)
+			{
+				RDT_TRACE(RTL_EVENT, RTE_DROP, 0, rcvd.hdr, 0);
+				continue;
+			}
+
+			// Carry the packet's ECN marking to its connection in the flags
+			rcvd.hdr.m_Flags &= ~RdtHeader::FLAG_CE;
+			if(bCe){ rcvd.hdr.m_Flags |= RdtHeader::FLAG_CE; }
+
+			Route(pConn, m_pRecvBatch->m_pAddrs[i], rcvd);
 		}
 	}
 
-	if((pUnacked = m_UnackedPackets.Peek()))
+	if(pConn->m_Inbound.Pop(&pkt))
 	{
-		assert(pUnacked->m_pPacket);
-		m_MinUnacked = pUnacked->m_pPacket->hdr.m_SeqNumber;
+		pConn->m_bInboundDrained = (pConn->m_Inbound.Size() == 0);
+		return EDR_PACKET;
+	}
+
+	return count ? EDR_ROUTED : EDR_EMPTY;
+}
+
+void RdtConnection::Route(RdtConnection *pConn, const sockaddr &addr, const RdtPacket &pkt)
+{
+	PeerKey key(addr);
+	auto iter = m_Connections.find(key);
+
+	// If SYN from an unknown peer, handle only if listener
+	if(iter == m_Connections.end() &&
+	   (pkt.hdr.m_Flags & ~RdtHeader::FLAG_CE) == RdtHeader::FLAG_SYN)
+	{
+		if(m_IsListener)
+		{
+			PendingConnection pending;
+			pending.addr = addr;
+			pending.seqNum = pkt.hdr.m_SeqNumber;
+
+			// Wake the listener's thread if another connection read the SYN
+			if(m_PendingConnections.Push(pending) && pConn != this) // Ignore if no room
+			{
+				m_pEventLoop->Notify();
+			}
+		}
+	}
+	// Only accept packets from connected peers
+	else if(iter == m_Connections.end())
+	{
+		RDT_TRACE(RTL_EVENT, RTE_DROP, 0, pkt.hdr, 0);
 	}
 	else
 	{
-		m_MinUnacked = -1;
+		// Wake the connection's thread if it may be sleeping
+		RdtConnection *pTarget = iter->second;
+		bool bWasEmpty = (pTarget->m_Inbound.Peek() == nullptr);
+		if(pTarget->m_Inbound.Push(pkt) && bWasEmpty && // Drop if no room
+		   pTarget != pConn)
+		{
+			pTarget->m_pEventLoop->Notify();
+		}
+	}
+}
+
+void RdtConnection::Resend(uint64_t currTime)
+{
+	RdtTimer *pTimer;
+	while((pTimer = m_pEventLoop->Timers().Expire(currTime)))
+	{
+		RdtConnection *pOwner = static_cast<RdtConnection*>(pTimer->m_pOwner);
+		if(pTimer == &pOwner->m_AckTimer)
+		{
+			pOwner->SendPendingAck();
+		}
+		else if(pTimer == &pOwner->m_ProbeTimer)
+		{
+			pOwner->SendProbe(currTime);
+		}
+		else if(pTimer == &pOwner->m_PaceTimer)
+		{
+			// Only there to wake the owner, which sends once it next checks
+			// CanSend(); it mustn't sleep before then if it is us
+			pOwner->m_bPaceDue = true;
+		}
+		else if(pTimer == &pOwner->m_LingerTimer)
+		{
+			// Only there to wake an owner driven through Process()
+		}
+		else
+		{
+			pOwner->Resend(pOwner->m_Unacked.SlotOf(pTimer), currTime);
+		}
+
+		// The owner may not get to flush its own queue until we sleep
+		if(pOwner != this)
+		{
+			pOwner->Flush();
+		}
+	}
+}
+
+void RdtConnection::Resend(int slot, uint64_t currTime)
+{
+	m_Rtt.OnTimeout(currTime);
+	m_pCongestion->OnTimeout(currTime, m_WndCurr);
+	Retransmit(slot, currTime);
+}
+
+void RdtConnection::Retransmit(int slot, uint64_t currTime)
+{
+	m_pCongestion->OnLoss(currTime, m_Unacked.Length(slot), m_WndCurr);
+	m_WndSize = m_pCongestion->Window();
+	Send(m_Unacked.Packet(slot), true, false, m_Unacked.Payload(slot));
+	m_Unacked.SetResent(slot, currTime);
+	m_pEventLoop->Timers().Schedule(m_Unacked.Timer(slot), currTime + m_Rtt.Rto());
+}
+
+void RdtConnection::DetectLosses(uint64_t currTime)
+{
+	if(m_RackSendTime == 0)
+	{
+		return;
+	}
+
+	// Allow for a quarter of the minimum RTT of reordering, as RACK does
+	uint64_t reorder = std::max(m_Rtt.MinRtt() / 4, (uint64_t)1 << RDT_TS_SHIFT);
+
+	// Only packets before the newest one to arrive can have been overtaken.
+	// Retransmitted packets are sent after it, so aren't deemed lost again
+	// until something sent after them arrives.
+	int slot = m_Unacked.Front();
+	while(slot != -1 && SeqBefore(m_Unacked.Seq(slot), m_RackEndSeq))
+	{
+		uint32_t next = m_Unacked.Seq(slot) + m_Unacked.Length(slot);
+		uint64_t sent = m_Unacked.SendTime(slot);
+		if(slot != m_SynIndex && sent < m_RackSendTime &&
+		   (sent + reorder <= m_RackSendTime ||
+			SeqDist(next, m_RackEndSeq) >= RDT_REORDER_THRESH * RDT_SEGMENT))
+		{
+			Retransmit(slot, currTime);
+		}
+		slot = m_Unacked.LowerBound(next);
+	}
+}
+
+void RdtConnection::ArmProbe(uint64_t currTime)
+{
+	// Without an RTT sample, or when the RTO is about as soon, there is
+	// nothing to gain over waiting for the RTO
+	uint64_t timeout = 2 * m_Rtt.Srtt();
+	if(m_Unacked.Front() == -1 || timeout == 0 || timeout >= m_Rtt.Rto())
+	{
+		m_pEventLoop->Timers().Cancel(&m_ProbeTimer);
+		return;
+	}
+
+	m_pEventLoop->Timers().Schedule(&m_ProbeTimer, currTime + timeout);
+}
+
+void RdtConnection::SendProbe(uint64_t currTime)
+{
+	// A probe neither counts as a loss nor backs off the RTO
+	int slot = m_Unacked.Back();
+	if(slot != -1 && slot != m_SynIndex)
+	{
+		Send(m_Unacked.Packet(slot), true, false, m_Unacked.Payload(slot));
+		m_Unacked.SetResent(slot, currTime);
+		Flush();
+	}
+}
+
+bool RdtConnection::Send(RdtPacket *pPkt, bool isResend, bool isSyn,
+						 const char *pPayload)
+{
+	uint16_t len = pPkt->hdr.m_MsgLen;
+
+	if(!isResend && pPkt->hdr.m_Flags != RdtHeader::FLAG_ACK &&
+	   pPkt->hdr.m_Flags != (RdtHeader::FLAG_ACK | RdtHeader::FLAG_FIN))
+	{
+		// Track the packet until it is ACKed, resending it if it isn't ACKed
+		// within an RTO
+		uint64_t now = RdtNow();
+		int slot = m_Unacked.Push(pPkt, pPayload, now);
+		if(slot == -1)
+		{
+			assert(0);
+			return false;
+		}
+
+		RdtTimer *pTimer = m_Unacked.Timer(slot);
+		pTimer->m_pOwner = this;
+		m_pEventLoop->Timers().Schedule(pTimer, now + m_Rtt.Rto());
+
+		if(isSyn){ m_SynIndex = slot; }
+		ArmProbe(now);
+
+		// Update variables; the windows count sequence space, which for a
+		// short data packet is more than it carries
+		uint32_t space = pPkt->hdr.SeqSpace();
+		m_Pacer.OnSend(now, len);
+		if(s_GlobalMaxRate != 0)
+		{
+			std::lock_guard<std::mutex> lock(s_GlobalPacerMutex);
+			s_GlobalPacer.OnSend(now, len);
+		}
+		m_pCongestion->OnSend(now, space, m_WndCurr);
+		m_WndCurr += space;
+		m_NextSeq = pPkt->hdr.m_SeqNumber + space;
+	}
+
+	// Stamp everything that will be ACKed; ACKs instead echo the timestamp
+	// of the packet they acknowledge
+	if(pPkt->hdr.m_Flags != RdtHeader::FLAG_ACK &&
+	   pPkt->hdr.m_Flags != (RdtHeader::FLAG_ACK | RdtHeader::FLAG_FIN))
+	{
+		pPkt->hdr.m_Timestamp = RdtTimestamp(RdtNow());
+	}
+
+	// Queue a network-order copy, since ACKs are sent from the stack
+	if(m_pSendBatch->m_Count == m_pSendBatch->m_Slots && !Flush())
+	{
+		return false;
+	}
+
+	// A payload referenced in place is gathered straight from its source
+	int i = m_pSendBatch->m_Count++;
+	size_t inlineLen = pPayload ? sizeof(RdtHeader) : len;
+	RdtPacket *pQueued = reinterpret_cast<RdtPacket*>(m_pSendBatch->Buffer(i));
+	memcpy(pQueued->msg, pPkt->msg, inlineLen);
+	pQueued->hdr.hton();
+
+	iovec *pIov = m_pSendBatch->Iov(i);
+	pIov[0].iov_len = inlineLen;
+	pIov[1].iov_base = const_cast<char*>(pPayload);
+	pIov[1].iov_len = len - inlineLen;
+
+	RDT_TRACE(RTL_PACKET, isResend ? RTE_RESEND : RTE_SEND, m_TraceId, pPkt->hdr, m_WndSize);
+
+	return true;
+}
+
+void RdtConnection::SendAck(const RdtHeader &hdr)
+{
+	// Echo the sequence number and timestamp of the packet being ACKed
+	RdtPacket ack;
+	ack.hdr = hdr;
+	ack.hdr.m_Flags = RdtHeader::FLAG_ACK;
+	ack.hdr.m_MsgLen = sizeof(RdtHeader);
+
+	// Once we know where the data starts, advertise our receive window and
+	// report everything received, so a single ACK covers a whole batch and
+	// makes up for any ACKs lost before it
+	if(m_bRecvSynced)
+	{
+		RdtAckInfo info;
+		info.m_CumAck = m_Reassembly.ReadyEnd();
+		info.m_RecvWnd = m_Reassembly.Space();
+		info.m_CeCount = m_CeCount;
+		m_AdvertisedEdge = info.m_CumAck + info.m_RecvWnd;
+		info.hton();
+		memcpy(&ack.msg[sizeof(RdtHeader)], &info, sizeof(info));
+		ack.hdr.m_MsgLen += sizeof(RdtAckInfo);
+
+		RdtSackBlock blocks[RDT_MAX_SACK_BLOCKS];
+		int count = m_Reassembly.GetBlocks(blocks, RDT_MAX_SACK_BLOCKS);
+		for(int i = 0; i < count; ++i)
+		{
+			blocks[i].hton();
+		}
+		memcpy(&ack.msg[ack.hdr.m_MsgLen], blocks, count * sizeof(RdtSackBlock));
+		ack.hdr.m_MsgLen += count * sizeof(RdtSackBlock);
+	}
+
+	Send(&ack);
+}
+
+void RdtConnection::SendPendingAck()
+{
+	if(m_bAckPending)
+	{
+		m_pEventLoop->Timers().Cancel(&m_AckTimer);
+		m_bAckPending = false;
+		m_bAckNow = false;
+		m_AckCount = 0;
+		SendAck(m_AckHdr);
+		Flush();
+	}
+}
+
+void RdtConnection::TraceConnect()
+{
+	if(RDT_TRACE_LEVEL < RTL_EVENT || !RdtTrace::IsEnabled(RTL_EVENT))
+	{
+		return;
+	}
+
+	// Our port is only known once a datagram has been sent
+	Flush();
+	sockaddr local = {};
+	socklen_t len = sizeof(local);
+	getsockname(m_UdpSocket, &local, &len);
+
+	// An unbound socket reports no address; ask the routing table which one
+	// reaches the peer
+	sockaddr_in &localIn = reinterpret_cast<sockaddr_in&>(local);
+	if(localIn.sin_addr.s_addr == htonl(INADDR_ANY))
+	{
+		int probe = socket(AF_INET, SOCK_DGRAM, 0);
+		sockaddr route = {};
+		len = sizeof(route);
+		if(probe != -1 && connect(probe, m_pAddr, sizeof(sockaddr_in)) == 0 &&
+		   getsockname(probe, &route, &len) == 0)
+		{
+			localIn.sin_addr = reinterpret_cast<sockaddr_in&>(route).sin_addr;
+		}
+		close(probe);
+	}
+
+	RdtTrace::RecordConnect(m_TraceId, local, *m_pAddr);
+}
+
+bool RdtConnection::IsDuplicate(const RdtHeader &hdr) const
+{
+	const uint16_t control = RdtHeader::FLAG_SYN | RdtHeader::FLAG_FIN |
+		RdtHeader::FLAG_ACK | RdtHeader::FLAG_RQST;
+
+	// The reassembly ring starts at the first packet not yet read once
+	// synced, so it knows about everything already read or still buffered
+	return !(hdr.m_Flags & control) && m_bRecvSynced &&
+		m_Reassembly.Contains(hdr.m_SeqNumber);
+}
+
+RdtPacket *RdtConnection::AllocPacket()
+{
+	// A shared pool may be exhausted by other connections. Nothing wakes us
+	// when they free packets, so keep processing our own traffic and retry
+	// every RDT_POOL_RETRY_MS.
+	RdtPacket *pPkt;
+	while(!(pPkt = m_pPool->Alloc()))
+	{
+		if(m_bNonBlocking)
+		{
+			errno = EAGAIN;
+			return nullptr;
+		}
+
+		if(Update(nullptr, RdtNow() + RDT_POOL_RETRY_MS * RDT_NS_PER_MS) == -1)
+		{
+			return nullptr;
+		}
+	}
+
+	return pPkt;
+}
+
+void RdtConnection::FreePacket(int slot)
+{
+	if(m_Unacked.Payload(slot))
+	{
+		m_HeaderPool.Free(m_Unacked.Packet(slot));
+	}
+	else
+	{
+		m_pPool->Free(m_Unacked.Packet(slot));
+	}
+}
+
+void RdtConnection::ClearUnacked()
+{
+	int slot;
+	while((slot = m_Unacked.Front()) != -1)
+	{
+		m_pEventLoop->Timers().Cancel(m_Unacked.Timer(slot));
+		FreePacket(slot);
+		m_Unacked.Remove(slot);
+	}
+
+	m_pEventLoop->Timers().Cancel(&m_ProbeTimer);
+	m_pEventLoop->Timers().Cancel(&m_PaceTimer);
+	m_SynIndex = -1;
+	m_WndCurr = 0;
+	m_RackSendTime = 0;
+}
+
+bool RdtConnection::Flush()
+{
+	RdtIoBatch &batch = *m_pSendBatch;
+	bool bGso = m_pListener->m_bGso.load(std::memory_order_relaxed);
+
+	// Hand runs of equally sized packets (only the last may be shorter) to
+	// the kernel as single GSO buffers, which it splits back into datagrams
+	int msgCount = 0;
+	for(int i = 0; i < batch.m_Count; ++msgCount)
+	{
+		size_t segSize = batch.Length(i);
+		int run = 1;
+		while(bGso && i + run < batch.m_Count &&
+			  batch.Length(i + run - 1) == segSize &&
+			  batch.Length(i + run) <= segSize)
+		{
+			++run;
+		}
+
+		msghdr &hdr = batch.m_pMsgs[msgCount].msg_hdr;
+		hdr.msg_name = m_pAddr;
+		hdr.msg_namelen = m_AddrLen;
+		hdr.msg_iov = batch.Iov(i);
+		hdr.msg_iovlen = run * RdtIoBatch::IOV_PER_SLOT;
+		hdr.msg_control = nullptr;
+		hdr.msg_controllen = 0;
+		if(run > 1)
+		{
+			uint16_t gsoSize = segSize;
+			hdr.msg_control = batch.Control(msgCount);
+			hdr.msg_controllen = CMSG_SPACE(sizeof(gsoSize));
+			cmsghdr *pCmsg = CMSG_FIRSTHDR(&hdr);
+			pCmsg->cmsg_level = SOL_UDP;
+			pCmsg->cmsg_type = UDP_SEGMENT;
+			pCmsg->cmsg_len = CMSG_LEN(sizeof(gsoSize));
+			memcpy(CMSG_DATA(pCmsg), &gsoSize, sizeof(gsoSize));
+		}
+
+		i += run;
+	}
+
+	int sent = 0;
+	bool bResult = true;
+	while(sent < msgCount)
+	{
+		RdtUring &uring = m_pListener->m_Uring;
+		int result = uring.IsActive() ?
+			uring.SendMsgs(m_UdpSocket, &batch.m_pMsgs[sent], msgCount - sent) :
+			sendmmsg(m_UdpSocket, &batch.m_pMsgs[sent], msgCount - sent, 0);
+		if(result == -1)
+		{
+			if(errno == EINTR){ continue; }
+
+			// Only errors about the segmentation request itself mean the
+			// route can't offload it; others are as transient as they are
+			// for a single packet
+			msghdr &hdr = batch.m_pMsgs[sent].msg_hdr;
+			if(hdr.msg_controllen != 0 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				// The route can't offload segmentation after all, so stop
+				// trying and send this run one packet at a time
+				m_pListener->m_bGso.store(false, std::memory_order_relaxed);
+				msghdr single = hdr;
+				single.msg_iovlen = RdtIoBatch::IOV_PER_SLOT;
+				single.msg_control = nullptr;
+				single.msg_controllen = 0;
+				for(size_t j = 0; j < hdr.msg_iovlen; j += RdtIoBatch::IOV_PER_SLOT)
+				{
+					single.msg_iov = &hdr.msg_iov[j];
+					if(sendmsg(m_UdpSocket, &single, 0) == -1)
+					{
+						ERROR(ERR_SEND, false);
+						bResult = false;
+					}
+				}
+			}
+			else
+			{
+				// Treat the failed packets as lost and carry on with the rest
+				ERROR(ERR_SEND, false);
+				bResult = false;
+			}
+
+			result = 1;
+		}
+
+		sent += result;
+	}
+
+	batch.m_Count = 0;
+	return bResult;
+}
+
+void RdtConnection::FlushAndArm()
+{
+	Flush();
+
+	// Without a blocking call to sleep until the next timer, Fd() has to
+	// wake the application for it
+	m_pEventLoop->Arm(m_pEventLoop->Timers().NextDeadline());
+}
+
+void RdtConnection::ConfigureOffload()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	// Sending with UDP_SEGMENT needs no setup, so just check the kernel knows it
+	int value = 0;
+	socklen_t len = sizeof(value);
+	m_bGso.store(m_bOffload &&
+		getsockopt(m_UdpSocket, SOL_UDP, UDP_SEGMENT, &value, &len) == 0,
+		std::memory_order_relaxed);
+
+	// A ring set up without offload has no buffers to take aggregates in
+	bool bGro = m_bOffload &&
+		(!m_Uring.IsActive() || m_Uring.PayloadSize() >= RDT_GRO_BUFSIZE);
+	value = bGro ? 1 : 0;
+	m_bGro = setsockopt(m_UdpSocket, SOL_UDP, UDP_GRO, &value, sizeof(value)) == 0 &&
+		bGro;
+
+	// GRO aggregates need buffers far larger than a packet
+	size_t bufSize = m_bGro ? RDT_GRO_BUFSIZE : RDT_MAX_PKTSIZE;
+	if(!m_pRecvBatch || m_pRecvBatch->m_BufSize != bufSize)
+	{
+		delete m_pRecvBatch;
+		m_pRecvBatch = new RdtIoBatch(m_bGro ? RDT_GRO_BATCH : RDT_IO_BATCH, bufSize);
+	}
+}
+
+void RdtConnection::ConfigureUring()
+{
+	m_Uring.Shutdown();
+	if(m_IoBackend != EIB_URING)
+	{
+		return;
+	}
+
+	// Failing leaves the socket to system calls
+	if(m_bOffload)
+	{
+		m_Uring.Initialize(m_UdpSocket, RDT_GRO_BUFSIZE, RDT_URING_GRO_BUFFERS);
+	}
+	else
+	{
+		m_Uring.Initialize(m_UdpSocket, RDT_MAX_PKTSIZE, RDT_URING_BUFFERS);
+	}
+}
+
+int RdtConnection::WatchedFd() const
+{
+	const RdtUring &uring = m_pListener->m_Uring;
+	return uring.IsActive() ? uring.EventFd() : m_UdpSocket;
+}
+
+void RdtConnection::ConfigureEcn()
+{
+	// Failing either just leaves the connection without ECN
+	int tos = m_bEcn ? RDT_ECN_ECT0 : 0;
+	setsockopt(m_UdpSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+	int value = m_bEcn ? 1 : 0;
+	setsockopt(m_UdpSocket, IPPROTO_IP, IP_RECVTOS, &value, sizeof(value));
+}
+
+bool RdtConnection::CanSend(uint16_t len)
+{
+	if(m_Unacked.IsFull())
+	{
+		return false;
+	}
+
+	// Congestion window spans from the oldest unacked packet
+	int front = m_Unacked.Front();
+	if(front != -1 &&
+	   SeqDist(m_Unacked.Seq(front), m_NextSeq) + len > m_WndSize)
+	{
+		return false;
+	}
+
+	// Flow-control window spans from the receiver's next expected packet.
+	// With nothing in flight a packet goes out regardless, which probes a
+	// closed window in case the ACK reopening it was lost.
+	if(m_bPeerWndValid && front != -1 &&
+	   SeqDist(m_PeerCumAck, m_NextSeq) + len > m_PeerWnd)
+	{
+		return false;
+	}
+
+	// Hold the packet back until both our pacer and the global one let it
+	// out, and have the timer wheel wake us then
+	uint64_t now = RdtNow();
+	m_Pacer.SetRate(PacingRate());
+	uint64_t release = m_Pacer.ReleaseTime(now);
+	if(s_GlobalMaxRate != 0)
+	{
+		std::lock_guard<std::mutex> lock(s_GlobalPacerMutex);
+		release = std::max(release, s_GlobalPacer.ReleaseTime(now));
+	}
+
+	m_bPaceDue = false;
+	if(release > now)
+	{
+		m_pEventLoop->Timers().Schedule(&m_PaceTimer, release);
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t RdtConnection::PacingRate() const
+{
+	uint64_t rate = 0;
+	if(m_bPacing)
+	{
+		rate = m_pCongestion->PacingRate();
+		if(rate == 0 && m_Rtt.Srtt() != 0)
+		{
+			rate = (uint64_t)m_WndSize * RDT_PACE_GAIN_PCT * 10000000 / m_Rtt.Srtt();
+		}
+	}
+
+	if(m_MaxRate != 0)
+	{
+		rate = (rate != 0) ? std::min(rate, m_MaxRate) : m_MaxRate;
+	}
+	return rate;
+}
+
+int RdtConnection::Recv()
+{
+	RdtIoBatch &batch = *m_pRecvBatch;
+	if(m_Uring.IsActive())
+	{
+		return m_Uring.Recv(batch);
+	}
+
+	for(int i = 0; i < batch.m_Slots; ++i)
+	{
+		msghdr &hdr = batch.m_pMsgs[i].msg_hdr;
+		batch.Iov(i)[0].iov_base = batch.Buffer(i);
+		batch.Iov(i)[0].iov_len = batch.m_BufSize;
+		hdr.msg_iov = batch.Iov(i);
+		hdr.msg_iovlen = 1;
+		hdr.msg_name = &batch.m_pAddrs[i];
+		hdr.msg_namelen = sizeof(sockaddr);
+		hdr.msg_control = batch.Control(i);
+		hdr.msg_controllen = RdtIoBatch::CONTROL_SIZE;
+	}
+
+	int count = recvmmsg(m_UdpSocket, batch.m_pMsgs, batch.m_Slots, MSG_DONTWAIT, nullptr);
+	if(count == -1)
+	{
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+
+	return count;
+}
+
+void RdtConnection::Ack(int slot, uint64_t rtt)
+{
+	if(m_Unacked.Packet(slot) == nullptr)
+	{
+		return;
+	}
+
+	m_pEventLoop->Timers().Cancel(m_Unacked.Timer(slot));
+
+	// Track the newest transmission known to have arrived. The ACK's echoed
+	// timestamp identifies which one it was; otherwise only a packet sent
+	// once is unambiguous.
+	uint64_t now = RdtNow();
+	uint16_t len = m_Unacked.Length(slot);
+	uint64_t sent = rtt ? now - rtt :
+		(m_Unacked.IsResent(slot) ? 0 : m_Unacked.SendTime(slot));
+	uint32_t end = m_Unacked.Seq(slot) + len;
+	if(m_RackSendTime == 0 || SeqBefore(m_RackEndSeq, end))
+	{
+		m_RackEndSeq = end;
+	}
+	m_RackSendTime = std::max(m_RackSendTime, sent);
+
+	m_pCongestion->OnAck(now, len, rtt, m_WndCurr);
+	m_WndSize = m_pCongestion->Window();
+	m_WndCurr -= len;
+	FreePacket(slot);
+	m_Unacked.Remove(slot);
+}
+
+void RdtConnection::AckRange(uint32_t start, uint32_t end)
+{
+	int slot = m_Unacked.LowerBound(start);
+	while(slot != -1)
+	{
+		uint32_t next = m_Unacked.Seq(slot) + m_Unacked.Length(slot);
+		if(SeqBefore(end, next))
+		{
+			break;
+		}
+
+		if(slot != m_SynIndex)
+		{
+			Ack(slot);
+		}
+		slot = m_Unacked.LowerBound(next);
 	}
 }
 
 void RdtHeader::hton()
 {
-	m_SeqNumber = htons(m_SeqNumber);
-	m_Reserved = htons(m_Reserved);
+	m_SeqNumber = htonl(m_SeqNumber);
+	m_Timestamp = htonl(m_Timestamp);
 	m_MsgLen = htons(m_MsgLen);
 	m_Flags = htons(m_Flags);
 }
 
 void RdtHeader::ntoh()
 {
-	m_SeqNumber = ntohs(m_SeqNumber);
-	m_Reserved = ntohs(m_Reserved);
+	m_SeqNumber = ntohl(m_SeqNumber);
+	m_Timestamp = ntohl(m_Timestamp);
 	m_MsgLen = ntohs(m_MsgLen);
 	m_Flags = ntohs(m_Flags);
 }
+
+void RdtAckInfo::hton()
+{
+	m_CumAck = htonl(m_CumAck);
+	m_RecvWnd = htonl(m_RecvWnd);
+	m_CeCount = htonl(m_CeCount);
+}
+
+void RdtAckInfo::ntoh()
+{
+	m_CumAck = ntohl(m_CumAck);
+	m_RecvWnd = ntohl(m_RecvWnd);
+	m_CeCount = ntohl(m_CeCount);
+}
+
+void RdtSackBlock::hton()
+{
+	m_Start = htonl(m_Start);
+	m_End = htonl(m_End);
+}
+
+void RdtSackBlock::ntoh()
+{
+	m_Start = ntohl(m_Start);
+	m_End = ntohl(m_End);
+}
+
+void RdtStreamHeader::hton()
+{
+	m_Stream = htonl(m_Stream);
+	m_PrevDist = htonl(m_PrevDist);
+}
+
+void RdtStreamHeader::ntoh()
+{
+	m_Stream = ntohl(m_Stream);
+	m_PrevDist = ntohl(m_PrevDist);
+}
@@ -0,0 +1,334 @@
+/* File: rdt_congestion.cpp
+ * Description: Implementation of the built-in congestion controllers
+ */
+
+#include "rdt_congestion.h"
+#include <algorithm>
+#include <cmath>
+
+#define CC_SEGMENT RDT_SEGMENT // Sequence space counted as one packet
+#define CC_MIN_WND MULT<RDT_MAX_PKTSIZE,2>::val
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+#define BBR_STARTUP_GAIN 2.885 // 2/ln(2)
+#define BBR_CWND_GAIN 2.0
+#define BBR_MIN_WND MULT<RDT_MAX_PKTSIZE,4>::val
+#define BBR_MIN_RTT_WINDOW_NS (10000 * RDT_NS_PER_MS)
+#define BBR_PROBE_RTT_NS (200 * RDT_NS_PER_MS)
+
+static const double BBR_GAIN_CYCLE[] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+CongestionController *CongestionController::Create(ECongestionControl algorithm)
+{
+	switch(algorithm)
+	{
+	case ECC_NEWRENO:
+		return new NewRenoController;
+	case ECC_BBR:
+		return new BbrController;
+	case ECC_CUBIC:
+	default:
+		return new CubicController;
+	}
+}
+
+//
+// NewReno
+//
+
+NewRenoController::NewRenoController() :
+	m_Cwnd(RDT_WNDSIZE), m_Ssthresh(UINT32_MAX), m_Srtt(0), m_RecoveryEnd(0)
+{
+}
+
+uint32_t NewRenoController::Window() const
+{
+	return (uint32_t)std::min(std::max(m_Cwnd, (double)CC_MIN_WND),
+							  (double)m_MaxWindow);
+}
+
+void NewRenoController::OnAck(uint64_t now, uint32_t bytes, uint64_t rtt,
+							  uint32_t inFlight)
+{
+	if(rtt)
+	{
+		m_Srtt = m_Srtt ? (7 * m_Srtt + rtt) / 8 : rtt;
+	}
+
+	// Don't grow a window the sender isn't using
+	if(2 * (uint64_t)inFlight < Window())
+	{
+		return;
+	}
+
+	if(m_Cwnd < m_Ssthresh)
+	{
+		m_Cwnd += bytes;
+	}
+	else
+	{
+		CongestionAvoidance(now, bytes);
+	}
+
+	m_Cwnd = std::min(m_Cwnd, (double)m_MaxWindow);
+}
+
+void NewRenoController::OnLoss(uint64_t now, uint32_t, uint32_t)
+{
+	// Every packet lost from one window counts as a single congestion event
+	if(now < m_RecoveryEnd)
+	{
+		return;
+	}
+
+	Reduce(now);
+	m_RecoveryEnd = now + (m_Srtt ? m_Srtt : RDT_RTO_MS * RDT_NS_PER_MS);
+}
+
+void NewRenoController::CongestionAvoidance(uint64_t, uint32_t bytes)
+{
+	m_Cwnd += (double)CC_SEGMENT * bytes / m_Cwnd;
+}
+
+void NewRenoController::Reduce(uint64_t)
+{
+	m_Ssthresh = std::max(m_Cwnd / 2, (double)CC_MIN_WND);
+	m_Cwnd = m_Ssthresh;
+}
+
+//
+// CUBIC
+//
+
+CubicController::CubicController() :
+	m_WMax(0), m_K(0), m_WEst(0), m_EpochStart(0)
+{
+}
+
+void CubicController::CongestionAvoidance(uint64_t now, uint32_t bytes)
+{
+	double cwnd = m_Cwnd / CC_SEGMENT;
+	double acked = (double)bytes / CC_SEGMENT;
+
+	if(m_EpochStart == 0)
+	{
+		m_EpochStart = now;
+		if(cwnd < m_WMax)
+		{
+			m_K = std::cbrt((m_WMax - cwnd) / CUBIC_C);
+		}
+		else
+		{
+			m_K = 0;
+			m_WMax = cwnd;
+		}
+		m_WEst = cwnd;
+	}
+
+	// Aim for where the curve will be one RTT from now
+	double t = (double)(now - m_EpochStart + m_Srtt) / 1e9;
+	double target = m_WMax + CUBIC_C * std::pow(t - m_K, 3);
+	target = std::min(target, 1.5 * cwnd);
+
+	if(target > cwnd)
+	{
+		cwnd += (target - cwnd) / cwnd * acked;
+	}
+	else
+	{
+		cwnd += 0.01 * acked / cwnd;
+	}
+
+	// Never grow slower than Reno would on the same path
+	m_WEst += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cwnd;
+	cwnd = std::max(cwnd, m_WEst);
+
+	m_Cwnd = cwnd * CC_SEGMENT;
+}
+
+void CubicController::Reduce(uint64_t)
+{
+	double cwnd = m_Cwnd / CC_SEGMENT;
+
+	// Fast convergence: release bandwidth to newer flows when the window
+	// keeps shrinking
+	m_WMax = (cwnd < m_WMax) ? cwnd * (1 + CUBIC_BETA) / 2 : cwnd;
+
+	m_Cwnd = std::max(m_Cwnd * CUBIC_BETA, (double)CC_MIN_WND);
+	m_Ssthresh = m_Cwnd;
+	m_EpochStart = 0;
+}
+
+//
+// BBR
+//
+
+BbrController::BbrController() :
+	m_State(ES_STARTUP), m_PacingGain(BBR_STARTUP_GAIN),
+	m_CwndGain(BBR_STARTUP_GAIN), m_Cwnd(RDT_WNDSIZE), m_Delivered(0),
+	m_RoundStart(0), m_RoundDelivered(0), m_RoundCount(0), m_MinRtt(0),
+	m_MinRttStamp(0), m_ProbeRttDone(0), m_FullBw(0), m_FullBwRounds(0),
+	m_CycleIndex(0), m_bEcnRound(false)
+{
+	std::fill(m_BwSamples, m_BwSamples + BW_FILTER_ROUNDS, 0);
+}
+
+uint32_t BbrController::Window() const
+{
+	uint32_t cwnd = (m_State == ES_PROBE_RTT) ? (uint32_t)BBR_MIN_WND : m_Cwnd;
+	return std::min(std::max(cwnd, (uint32_t)BBR_MIN_WND), m_MaxWindow);
+}
+
+uint64_t BbrController::PacingRate() const
+{
+	double gain = m_bEcnRound ? std::min(m_PacingGain, 1.0) : m_PacingGain;
+	return (uint64_t)(gain * MaxBandwidth());
+}
+
+void BbrController::OnAck(uint64_t now, uint32_t bytes, uint64_t rtt,
+						  uint32_t inFlight)
+{
+	m_Delivered += bytes;
+
+	// Track the propagation delay, probing for a new minimum once the current
+	// one is too old to trust
+	if(rtt)
+	{
+		rtt = std::max(rtt, (uint64_t)1 << RDT_TS_SHIFT);
+		bool bExpired = m_MinRtt && now > m_MinRttStamp + BBR_MIN_RTT_WINDOW_NS;
+		if(bExpired && m_State != ES_PROBE_RTT)
+		{
+			m_State = ES_PROBE_RTT;
+			m_ProbeRttDone = now + BBR_PROBE_RTT_NS;
+		}
+
+		if(!m_MinRtt || rtt <= m_MinRtt || bExpired)
+		{
+			m_MinRtt = rtt;
+			m_MinRttStamp = now;
+		}
+	}
+
+	// Resume with the gains of whichever state we return to
+	if(m_State == ES_PROBE_RTT && now >= m_ProbeRttDone)
+	{
+		m_MinRttStamp = now;
+		if(m_FullBwRounds >= 3)
+		{
+			m_State = ES_PROBE_BW;
+			m_CwndGain = BBR_CWND_GAIN;
+			m_CycleIndex = 0;
+			m_PacingGain = BBR_GAIN_CYCLE[m_CycleIndex];
+		}
+		else
+		{
+			m_State = ES_STARTUP;
+			m_CwndGain = BBR_STARTUP_GAIN;
+			m_PacingGain = BBR_STARTUP_GAIN;
+		}
+	}
+
+	// Sample the delivery rate once per round trip
+	if(m_RoundStart == 0)
+	{
+		m_RoundStart = now;
+		m_RoundDelivered = m_Delivered - bytes;
+	}
+	else if(m_MinRtt && now - m_RoundStart >= m_MinRtt)
+	{
+		EndRound(now, inFlight);
+	}
+
+	// Grow like slow start until the model yields a bandwidth-delay product
+	uint64_t target = (uint64_t)((m_bEcnRound ? 1 : m_CwndGain) * Bdp());
+	if(target == 0 || (m_State == ES_STARTUP && m_Cwnd < target))
+	{
+		m_Cwnd += bytes;
+	}
+	else
+	{
+		m_Cwnd = (uint32_t)std::min((uint64_t)m_Cwnd + bytes, target);
+	}
+
+	m_Cwnd = std::min(std::max(m_Cwnd, (uint32_t)BBR_MIN_WND), m_MaxWindow);
+}
+
+void BbrController::OnLoss(uint64_t, uint32_t, uint32_t)
+{
+	// Loss is not treated as a congestion signal; the bandwidth and delay
+	// estimates already bound what is kept in flight
+}
+
+void BbrController::OnTimeout(uint64_t, uint32_t)
+{
+	// A timeout means the model no longer says anything about the path, so
+	// send no more than the minimum until ACKs grow the window again
+	m_Cwnd = BBR_MIN_WND;
+}
+
+void BbrController::OnEcn(uint64_t, uint32_t)
+{
+	// The bottleneck queue is building, so stop adding to it: keep no more
+	// than the bandwidth-delay product in flight until the round ends
+	m_bEcnRound = true;
+	uint64_t bdp = Bdp();
+	if(bdp != 0)
+	{
+		m_Cwnd = (uint32_t)std::min((uint64_t)m_Cwnd, std::max(bdp, (uint64_t)BBR_MIN_WND));
+	}
+}
+
+void BbrController::EndRound(uint64_t now, uint32_t inFlight)
+{
+	uint64_t elapsed = now - m_RoundStart;
+	m_BwSamples[m_RoundCount % BW_FILTER_ROUNDS] =
+		(m_Delivered - m_RoundDelivered) * 1000000000 / elapsed;
+	++m_RoundCount;
+	m_RoundStart = now;
+	m_RoundDelivered = m_Delivered;
+	m_bEcnRound = false;
+
+	switch(m_State)
+	{
+	case ES_STARTUP:
+		// The pipe is full once the bandwidth stops growing by 25% per round
+		if(MaxBandwidth() >= m_FullBw * 5 / 4)
+		{
+			m_FullBw = MaxBandwidth();
+			m_FullBwRounds = 0;
+		}
+		else if(++m_FullBwRounds >= 3)
+		{
+			m_State = ES_DRAIN;
+			m_PacingGain = 1 / BBR_STARTUP_GAIN;
+		}
+		break;
+	case ES_DRAIN:
+		if(inFlight <= Bdp())
+		{
+			m_State = ES_PROBE_BW;
+			m_CwndGain = BBR_CWND_GAIN;
+			m_CycleIndex = 0;
+			m_PacingGain = BBR_GAIN_CYCLE[m_CycleIndex];
+		}
+		break;
+	case ES_PROBE_BW:
+		m_CycleIndex = (m_CycleIndex + 1) % GAIN_CYCLE_LEN;
+		m_PacingGain = BBR_GAIN_CYCLE[m_CycleIndex];
+		break;
+	case ES_PROBE_RTT:
+		break;
+	}
+}
+
+uint64_t BbrController::MaxBandwidth() const
+{
+	return *std::max_element(m_BwSamples, m_BwSamples + BW_FILTER_ROUNDS);
+}
+
+uint64_t BbrController::Bdp() const
+{
+	return MaxBandwidth() * m_MinRtt / 1000000000;
+}
@@ -0,0 +1,207 @@
+// File: rdt_congestion.h
+// Description: Header containing the congestion controllers that size the
+//              send window of an rdt connection.
+
+#ifndef _RDT_CONGESTION_H_
+#define _RDT_CONGESTION_H_
+
+#include <cstdint>
+#include "rdt_structures.h"
+
+enum ECongestionControl
+{
+	ECC_NEWRENO,
+	ECC_CUBIC,
+	ECC_BBR
+};
+
+/**
+ * @brief Interface for algorithms that adapt a connection's send window
+ *
+ * The connection reports every packet it sends, every packet that gets ACKed
+ * and every packet it considers lost; Window() then bounds the span of
+ * sequence space the sender may have outstanding.
+ */
+class CongestionController
+{
+public:
+	CongestionController() : m_MaxWindow(RDT_MAX_WNDSIZE){}
+	virtual ~CongestionController(){}
+
+	/**
+	 * @brief Creates one of the built-in controllers
+	 */
+	static CongestionController *Create(ECongestionControl algorithm);
+
+	/**
+	 * @brief Bytes of sequence space the sender may have outstanding
+	 */
+	virtual uint32_t Window() const = 0;
+
+	/**
+	 * @brief Rate at which packets should be spaced out, in bytes per second
+	 * @return 0 if this controller does not pace
+	 */
+	virtual uint64_t PacingRate() const{ return 0; }
+
+	/**
+	 * @brief Called when a packet is sent for the first time
+	 */
+	virtual void OnSend(uint64_t, uint32_t, uint32_t){}
+
+	/**
+	 * @brief Called when a previously unacked packet is ACKed
+	 * @param rtt Round trip time measured by the ACK, or 0 if none was
+	 */
+	virtual void OnAck(uint64_t now, uint32_t bytes, uint64_t rtt,
+					   uint32_t inFlight) = 0;
+
+	/**
+	 * @brief Called when an unacked packet is deemed lost
+	 */
+	virtual void OnLoss(uint64_t now, uint32_t bytes, uint32_t inFlight) = 0;
+
+	/**
+	 * @brief Called when a packet's retransmission timer expires, before
+	 *        OnLoss() is for the packet
+	 */
+	virtual void OnTimeout(uint64_t, uint32_t){}
+
+	/**
+	 * @brief Called when the receiver reports packets that were CE-marked
+	 *        by the network, which by default counts as a loss (RFC 3168)
+	 */
+	virtual void OnEcn(uint64_t now, uint32_t inFlight){ OnLoss(now, 0, inFlight); }
+
+	/**
+	 * @brief Caps the window at what the connection can actually keep track of
+	 */
+	void SetMaxWindow(uint32_t maxWindow){ m_MaxWindow = maxWindow; }
+
+protected:
+	uint32_t m_MaxWindow;
+};
+
+/**
+ * @brief Loss-based AIMD controller following TCP NewReno
+ *
+ * Slow start doubles the window every round trip until the first loss; after
+ * that the window grows by one packet per round trip and halves on loss, at
+ * most once per round trip.
+ */
+class NewRenoController : public CongestionController
+{
+public:
+	NewRenoController();
+
+	uint32_t Window() const override;
+	void OnAck(uint64_t now, uint32_t bytes, uint64_t rtt,
+			   uint32_t inFlight) override;
+	void OnLoss(uint64_t now, uint32_t bytes, uint32_t inFlight) override;
+
+protected:
+	/**
+	 * @brief Window growth once out of slow start
+	 */
+	virtual void CongestionAvoidance(uint64_t now, uint32_t bytes);
+
+	/**
+	 * @brief Multiplicative decrease applied on loss
+	 */
+	virtual void Reduce(uint64_t now);
+
+protected:
+	double m_Cwnd; // In bytes
+	double m_Ssthresh;
+	uint64_t m_Srtt;
+	uint64_t m_RecoveryEnd; // Further losses before this are the same event
+};
+
+/**
+ * @brief Loss-based controller following CUBIC (RFC 8312)
+ *
+ * After a loss the window grows along a cubic curve centred on the window
+ * at which the loss happened, which recovers bandwidth quickly on paths with
+ * a large bandwidth-delay product while staying TCP-friendly on short ones.
+ */
+class CubicController : public NewRenoController
+{
+public:
+	CubicController();
+
+protected:
+	void CongestionAvoidance(uint64_t now, uint32_t bytes) override;
+	void Reduce(uint64_t now) override;
+
+private:
+	double m_WMax; // Window before the last reduction, in packets
+	double m_K;
+	double m_WEst; // Reno-equivalent window, in packets
+	uint64_t m_EpochStart;
+};
+
+/**
+ * @brief Model-based controller in the spirit of BBR
+ *
+ * Rather than reacting to loss, estimates the bottleneck bandwidth (windowed
+ * maximum of the per-round delivery rate) and the round-trip propagation
+ * delay (windowed minimum RTT), and keeps about two bandwidth-delay products
+ * in flight while pacing at the estimated bandwidth. CE marks hold it to
+ * one bandwidth-delay product, paced at no more than the estimate, for the
+ * rest of the round.
+ */
+class BbrController : public CongestionController
+{
+public:
+	BbrController();
+
+	uint32_t Window() const override;
+	uint64_t PacingRate() const override;
+	void OnAck(uint64_t now, uint32_t bytes, uint64_t rtt,
+			   uint32_t inFlight) override;
+	void OnLoss(uint64_t now, uint32_t bytes, uint32_t inFlight) override;
+	void OnTimeout(uint64_t now, uint32_t inFlight) override;
+	void OnEcn(uint64_t now, uint32_t inFlight) override;
+
+private:
+	enum EState
+	{
+		ES_STARTUP,
+		ES_DRAIN,
+		ES_PROBE_BW,
+		ES_PROBE_RTT
+	};
+
+	enum
+	{
+		BW_FILTER_ROUNDS = 10,
+		GAIN_CYCLE_LEN = 8
+	};
+
+	void EndRound(uint64_t now, uint32_t inFlight);
+	uint64_t MaxBandwidth() const;
+	uint64_t Bdp() const;
+
+private:
+	EState m_State;
+	double m_PacingGain;
+	double m_CwndGain;
+	uint32_t m_Cwnd;
+
+	uint64_t m_Delivered;
+	uint64_t m_RoundStart;
+	uint64_t m_RoundDelivered;
+	uint64_t m_RoundCount;
+	uint64_t m_BwSamples[BW_FILTER_ROUNDS]; // Bytes per second, per round
+
+	uint64_t m_MinRtt;
+	uint64_t m_MinRttStamp;
+	uint64_t m_ProbeRttDone;
+
+	uint64_t m_FullBw;
+	int m_FullBwRounds;
+	int m_CycleIndex;
+	bool m_bEcnRound; // CE marks were reported this round
+};
+
+#endif //_RDT_CONGESTION_H_
@@ -22,7 +22,8 @@ static const std::string PROJECT_NAME = "libRDT";
 	f(ERR_CLOSE,        10, "Error on close")							\
 	f(ERR_HOST,         11, "Failed to get the host name")				\
 	f(ERR_CONNECT,      12, "Error on connecting to the host")			\
-	f(ERR_SEND,         13, "Error on sendto")
+	f(ERR_SEND,         13, "Error on sendto")							\
+	f(ERR_EPOLL,        14, "Error on epoll")
 
 #define _ERR_NAME(err, val, str) err,
 enum ERR{ ERR(_ERR_NAME) };
@@ -0,0 +1,205 @@
+/* File: rdt_event_loop.cpp
+ * Description: epoll/timerfd implementation of the RdtEventLoop class
+ */
+
+#include "rdt.h"
+#include <unistd.h>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+RdtEventLoop::RdtEventLoop() :
+	m_EpollFd(-1), m_TimerFd(-1), m_NotifyFd(-1), m_ArmedDeadline(0)
+{
+}
+
+RdtEventLoop::~RdtEventLoop()
+{
+	Shutdown();
+}
+
+int RdtEventLoop::Initialize()
+{
+	if(m_EpollFd != -1)
+	{
+		return 0;
+	}
+
+	m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+	m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	m_NotifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_EpollFd == -1 || m_TimerFd == -1 || m_NotifyFd == -1)
+	{
+		ERROR(ERR_EPOLL, false);
+		Shutdown();
+		return -1;
+	}
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint32_t)m_TimerFd;
+	if(epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_TimerFd, &ev) == -1)
+	{
+		ERROR(ERR_EPOLL, false);
+		Shutdown();
+		return -1;
+	}
+
+	ev.data.u64 = (uint32_t)m_NotifyFd;
+	if(epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_NotifyFd, &ev) == -1)
+	{
+		ERROR(ERR_EPOLL, false);
+		Shutdown();
+		return -1;
+	}
+
+	m_ArmedDeadline = 0;
+	return 0;
+}
+
+void RdtEventLoop::Shutdown()
+{
+	int *fds[] = { &m_EpollFd, &m_TimerFd, &m_NotifyFd };
+	for(int *pFd : fds)
+	{
+		if(*pFd != -1)
+		{
+			close(*pFd);
+			*pFd = -1;
+		}
+	}
+
+	m_Watches.clear();
+}
+
+int RdtEventLoop::Add(int fd, bool bCounter)
+{
+	if(++m_Watches[fd] > 1)
+	{
+		return 0;
+	}
+
+	// Counters are flagged above the fd, so that Collect() knows to reset them
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.u64 = (uint32_t)fd | ((uint64_t)bCounter << 32);
+	if(epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		// Older kernels don't support exclusive wakeups
+		ev.events = EPOLLIN;
+		if(errno != EINVAL || epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		{
+			m_Watches.erase(fd);
+			ERROR(ERR_EPOLL, false);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int RdtEventLoop::Remove(int fd)
+{
+	auto iter = m_Watches.find(fd);
+	if(iter != m_Watches.end())
+	{
+		if(--iter->second > 0)
+		{
+			return 0;
+		}
+
+		m_Watches.erase(iter);
+	}
+
+	if(epoll_ctl(m_EpollFd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+	{
+		ERROR(ERR_EPOLL, false);
+		return -1;
+	}
+
+	return 0;
+}
+
+int RdtEventLoop::Wait(uint64_t deadline)
+{
+	int timeout = -1;
+	if(deadline != 0 && deadline <= RdtNow())
+	{
+		timeout = 0;
+	}
+	else if(Arm(deadline) == -1)
+	{
+		return -1;
+	}
+
+	return Collect(timeout);
+}
+
+int RdtEventLoop::Arm(uint64_t deadline)
+{
+	// A deadline that has already passed fires straight away
+	return (deadline == m_ArmedDeadline) ? 0 : ArmTimer(deadline);
+}
+
+int RdtEventLoop::Drain()
+{
+	return Collect(0);
+}
+
+int RdtEventLoop::Collect(int timeout)
+{
+	epoll_event events[8];
+	int count = epoll_wait(m_EpollFd, events, 8, timeout);
+	if(count == -1)
+	{
+		if(errno == EINTR){ return 1; }
+		ERROR(ERR_EPOLL, false);
+		return -1;
+	}
+
+	int result = 0;
+	uint64_t value;
+	for(int i = 0; i < count; ++i)
+	{
+		int fd = (int)(uint32_t)events[i].data.u64;
+		if(fd == m_TimerFd)
+		{
+			// One-shot timer has now disarmed itself
+			if(read(m_TimerFd, &value, sizeof(value))){}
+			m_ArmedDeadline = 0;
+		}
+		else if(fd == m_NotifyFd || (events[i].data.u64 >> 32) != 0)
+		{
+			if(read(fd, &value, sizeof(value))){}
+			result = 1;
+		}
+		else
+		{
+			result = 1;
+		}
+	}
+
+	return result;
+}
+
+void RdtEventLoop::Notify()
+{
+	uint64_t value = 1;
+	if(write(m_NotifyFd, &value, sizeof(value))){}
+}
+
+int RdtEventLoop::ArmTimer(uint64_t deadline)
+{
+	itimerspec spec = {};
+	spec.it_value.tv_sec = deadline / 1000000000;
+	spec.it_value.tv_nsec = deadline % 1000000000;
+	if(timerfd_settime(m_TimerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1)
+	{
+		ERROR(ERR_EPOLL, false);
+		return -1;
+	}
+
+	m_ArmedDeadline = deadline;
+	return 0;
+}
@@ -0,0 +1,131 @@
+// File: rdt_event_loop.h
+// Description: Header containing the event loop that blocking rdt calls sleep
+//              in until a datagram arrives or a resend is due.
+
+#ifndef _RDT_EVENT_LOOP_H_
+#define _RDT_EVENT_LOOP_H_
+
+#include <cstdint>
+#include <ctime>
+#include <unordered_map>
+#include "rdt_timer_wheel.h"
+
+/**
+ * @brief Monotonic wall-clock time in nanoseconds
+ *
+ * Unlike clock(), which measures process CPU time, this keeps advancing while
+ * a connection sleeps in its event loop.
+ */
+inline uint64_t RdtNow()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Waits on sockets and a deadline without busy-polling
+ *
+ * Built on epoll, with a timerfd providing deadlines finer than epoll_wait's
+ * millisecond timeout. A loop may be shared by several connections (see
+ * RdtConnection::SetEventLoop()) as long as it is only waited on by one
+ * thread at a time; each connection registers its socket with the loop and
+ * is woken through Notify() when another thread queues packets for it.
+ *
+ * The loop also holds the timer wheel its connections schedule their
+ * retransmissions on, so connections sharing a loop share one wheel and
+ * sleep until a single deadline.
+ */
+class RdtEventLoop
+{
+public:
+	RdtEventLoop();
+	~RdtEventLoop();
+
+	/**
+	 * @brief Creates the epoll instance, timer and notification fd
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Initialize();
+
+	/**
+	 * @brief Closes all fds owned by the loop
+	 */
+	void Shutdown();
+
+	/**
+	 * @brief Watch fd for readability
+	 * @param bCounter fd is an eventfd, whose count is reset whenever it
+	 *        wakes the loop
+	 * @note fd is watched exclusively where supported, so that a socket shared
+	 *       by connections on different threads only wakes one of them. An fd
+	 *       added again, as by connections sharing both socket and loop, is
+	 *       only counted
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Add(int fd, bool bCounter=false);
+
+	/**
+	 * @brief Stop watching fd, once it has been removed as often as added
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Remove(int fd);
+
+	/**
+	 * @brief Blocks until a watched fd is readable, Notify() is called, or the
+	 *        deadline passes
+	 * @param deadline RdtNow() time to wake at, or 0 to wait indefinitely
+	 * @return 1 if woken by I/O, 0 if the deadline passed, -1 on error
+	 */
+	int Wait(uint64_t deadline);
+
+	/**
+	 * @brief Fd that polls readable whenever Wait() would return, for
+	 *        applications driving the loop from their own event loop
+	 */
+	int Fd() const{ return m_EpollFd; }
+
+	/**
+	 * @brief Makes Fd() readable once deadline passes
+	 * @param deadline RdtNow() time, or 0 for no deadline
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Arm(uint64_t deadline);
+
+	/**
+	 * @brief Consumes any wakeups that have made Fd() readable, without
+	 *        blocking
+	 * @return 1 if there was I/O, 0 if not, -1 on error
+	 */
+	int Drain();
+
+	/**
+	 * @brief Wakes the thread waiting on this loop
+	 * @note Safe to call from any thread
+	 */
+	void Notify();
+
+	/**
+	 * @brief Timers of the connections using this loop
+	 */
+	RdtTimerWheel &Timers(){ return m_Timers; }
+
+private:
+	int ArmTimer(uint64_t deadline);
+
+	/**
+	 * @brief Waits up to timeout ms (-1 for ever) for events and consumes them
+	 * @return 1 if woken by I/O, 0 if not, -1 on error
+	 */
+	int Collect(int timeout);
+
+private:
+	int m_EpollFd;
+	int m_TimerFd;
+	int m_NotifyFd;
+	uint64_t m_ArmedDeadline;
+	std::unordered_map<int,int> m_Watches; // Times each watched fd was added
+	RdtTimerWheel m_Timers;
+};
+
+#endif //_RDT_EVENT_LOOP_H_
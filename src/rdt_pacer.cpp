@@ -0,0 +1,29 @@
+/* File: rdt_pacer.cpp
+ * Description: Implementation of the RdtPacer class
+ */
+
+#include "rdt_pacer.h"
+
+uint64_t RdtPacer::ReleaseTime(uint64_t now) const
+{
+	if(m_Rate == 0)
+	{
+		return now;
+	}
+
+	// A packet may go as long as the bucket isn't more than a burst short
+	// of full
+	uint64_t burst = std::max(RDT_PACE_BURST_NS,
+							  2 * RDT_SEGMENT * (uint64_t)1000000000 / m_Rate);
+	return (m_FullTime > now + burst) ? m_FullTime - burst : now;
+}
+
+void RdtPacer::OnSend(uint64_t now, uint32_t bytes)
+{
+	if(m_Rate == 0)
+	{
+		return;
+	}
+
+	m_FullTime = std::max(m_FullTime, now) + bytes * (uint64_t)1000000000 / m_Rate;
+}
@@ -0,0 +1,51 @@
+// File: rdt_pacer.h
+// Description: Header containing the token bucket that spaces out the
+//              packets an rdt connection sends.
+
+#ifndef _RDT_PACER_H_
+#define _RDT_PACER_H_
+
+#include <cstdint>
+#include "rdt_structures.h"
+#include "rdt_timer_wheel.h"
+
+#define RDT_PACE_GAIN_PCT 125 // Pacing rate as a percentage of window / SRTT
+#define RDT_PACE_BURST_NS ((uint64_t)2 << RDT_TIMER_TICK_SHIFT) // Two wheel ticks
+
+/**
+ * @brief Token bucket limiting the rate packets are sent at
+ *
+ * The bucket is kept as the time it will next be full (the generic cell rate
+ * algorithm), so it is refilled implicitly and never needs a timer of its own.
+ * It holds RDT_PACE_BURST_NS worth of bytes, or two full packets if that is
+ * more. That lets a sender woken on a timer wheel tick catch up on the
+ * whole tick without falling behind the rate.
+ */
+class RdtPacer
+{
+public:
+	RdtPacer() : m_Rate(0), m_FullTime(0){}
+
+	/**
+	 * @brief Sets the rate in bytes per second, 0 for unlimited
+	 */
+	void SetRate(uint64_t bytesPerSec){ m_Rate = bytesPerSec; }
+	uint64_t Rate() const{ return m_Rate; }
+
+	/**
+	 * @brief Earliest RdtNow() time another packet may be sent at, which is
+	 *        now itself if it may be sent straight away
+	 */
+	uint64_t ReleaseTime(uint64_t now) const;
+
+	/**
+	 * @brief Takes bytes worth of tokens from the bucket
+	 */
+	void OnSend(uint64_t now, uint32_t bytes);
+
+private:
+	uint64_t m_Rate;
+	uint64_t m_FullTime; // When the bucket will be full again if nothing is sent
+};
+
+#endif //_RDT_PACER_H_
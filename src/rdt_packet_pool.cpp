@@ -0,0 +1,77 @@
+/* File: rdt_packet_pool.cpp
+ * Description: Implementation of the RdtPacketPool class
+ */
+
+#include "rdt_packet_pool.h"
+#include <cstdlib>
+
+RdtPacketPool::RdtPacketPool(size_t capacity, bool bShared, size_t packetSize) :
+	m_Capacity(capacity), m_Carved(0), m_pFree(nullptr), m_bShared(bShared)
+{
+	packetSize = std::max(packetSize, sizeof(FreeNode));
+	m_PacketSize = (packetSize + RDT_POOL_ALIGN - 1) / RDT_POOL_ALIGN * RDT_POOL_ALIGN;
+}
+
+RdtPacketPool::~RdtPacketPool()
+{
+	for(void *pSlab : m_Slabs)
+	{
+		free(pSlab);
+	}
+}
+
+RdtPacket *RdtPacketPool::Alloc()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex, std::defer_lock);
+	if(m_bShared){ lock.lock(); }
+
+	if(!m_pFree && !Grow())
+	{
+		return nullptr;
+	}
+
+	FreeNode *pNode = m_pFree;
+	m_pFree = pNode->m_pNext;
+	return reinterpret_cast<RdtPacket*>(pNode);
+}
+
+void RdtPacketPool::Free(RdtPacket *pPkt)
+{
+	if(!pPkt){ return; }
+
+	std::unique_lock<std::mutex> lock(m_Mutex, std::defer_lock);
+	if(m_bShared){ lock.lock(); }
+
+	FreeNode *pNode = reinterpret_cast<FreeNode*>(pPkt);
+	pNode->m_pNext = m_pFree;
+	m_pFree = pNode;
+}
+
+bool RdtPacketPool::Grow()
+{
+	size_t count = std::min((size_t)RDT_POOL_SLAB, m_Capacity - m_Carved);
+	if(count == 0)
+	{
+		return false;
+	}
+
+	void *pSlab;
+	if(posix_memalign(&pSlab, RDT_POOL_ALIGN, count * m_PacketSize) != 0)
+	{
+		return false;
+	}
+
+	m_Slabs.push_back(pSlab);
+	m_Carved += count;
+
+	// Thread the new packets onto the free list in address order
+	char *pPackets = static_cast<char*>(pSlab);
+	for(size_t i = count; i-- > 0;)
+	{
+		FreeNode *pNode = reinterpret_cast<FreeNode*>(pPackets + i * m_PacketSize);
+		pNode->m_pNext = m_pFree;
+		m_pFree = pNode;
+	}
+
+	return true;
+}
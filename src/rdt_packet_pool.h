@@ -0,0 +1,74 @@
+// File: rdt_packet_pool.h
+// Description: Header containing the pool that rdt connections allocate
+//              their outgoing packets from.
+
+#ifndef _RDT_PACKET_POOL_H_
+#define _RDT_PACKET_POOL_H_
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include "rdt_structures.h"
+
+#define RDT_POOL_SLAB 64 // Packets carved from each allocation
+#define RDT_POOL_ALIGN 64 // Cache line size
+#define RDT_POOL_RETRY_MS 1 // Polling interval while a shared pool is exhausted
+
+/**
+ * @brief Fixed-capacity free list of packets
+ *
+ * Packets are carved out of cache-aligned slabs, which are only allocated as
+ * the pool first grows and are kept until the pool is destroyed, so a
+ * connection in steady state recycles the same memory without touching the
+ * heap. A pool only locks if it was created to be shared by connections on
+ * several threads (see RdtConnection::SetPacketPool()).
+ */
+class RdtPacketPool
+{
+public:
+	/**
+	 * @param capacity Most packets that may be allocated at once
+	 * @param bShared Whether connections on different threads will share
+	 *        the pool
+	 * @param packetSize Bytes per packet, which may be less than a whole
+	 *        RdtPacket for packets that only ever hold a header
+	 */
+	explicit RdtPacketPool(size_t capacity = RDT_MAX_UNACKED + 1, bool bShared = false,
+						   size_t packetSize = sizeof(RdtPacket));
+	~RdtPacketPool();
+
+	RdtPacketPool(const RdtPacketPool&) = delete;
+	RdtPacketPool &operator=(const RdtPacketPool&) = delete;
+
+	/**
+	 * @return A packet, or nullptr if capacity packets are already in use
+	 */
+	RdtPacket *Alloc();
+
+	/**
+	 * @brief Returns a packet obtained from Alloc() to the pool
+	 */
+	void Free(RdtPacket *pPkt);
+
+	size_t Capacity() const{ return m_Capacity; }
+
+private:
+	struct FreeNode
+	{
+		FreeNode *m_pNext;
+	};
+
+	bool Grow();
+
+private:
+	size_t m_Capacity;
+	size_t m_PacketSize; // Rounded up to keep every packet cache-aligned
+	size_t m_Carved; // Packets carved out of slabs so far
+	FreeNode *m_pFree;
+	std::vector<void*> m_Slabs;
+
+	bool m_bShared;
+	std::mutex m_Mutex;
+};
+
+#endif //_RDT_PACKET_POOL_H_
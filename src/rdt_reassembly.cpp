@@ -0,0 +1,606 @@
+/* File: rdt_reassembly.cpp
+ * Description: Implementation of the RdtReassemblyBuffer class
+ */
+
+#include "rdt_reassembly.h"
+
+RdtReassemblyBuffer::RdtReassemblyBuffer() :
+	m_Slots(0), m_Head(0), m_BaseSeq(0), m_Stored(0), m_Ready(0), m_Unread(0),
+	m_ReadyEnds(0), m_ReadIndex(0), m_ReadOffset(0), m_pData(nullptr),
+	m_pLengths(nullptr), m_pFlags(nullptr), m_pNext(nullptr), m_pStreamIds(nullptr),
+	m_StreamCount(0)
+{
+}
+
+RdtReassemblyBuffer::~RdtReassemblyBuffer()
+{
+	delete[] m_pData;
+	delete[] m_pLengths;
+	delete[] m_pFlags;
+	delete[] m_pNext;
+	delete[] m_pStreamIds;
+}
+
+void RdtReassemblyBuffer::Initialize(uint32_t window)
+{
+	uint32_t slots = (window + RDT_SEGMENT - 1) / RDT_SEGMENT;
+	if(slots != m_Slots)
+	{
+		// Left uninitialized, so only the part of the window in use is ever
+		// backed by memory
+		delete[] m_pData;
+		delete[] m_pLengths;
+		delete[] m_pFlags;
+		delete[] m_pNext;
+		delete[] m_pStreamIds;
+		m_Slots = slots;
+		m_pData = new char[(size_t)m_Slots * RDT_MSS];
+		m_pLengths = new uint16_t[m_Slots];
+		m_pFlags = new uint8_t[m_Slots];
+		m_pNext = new uint32_t[m_Slots];
+		m_pStreamIds = new uint32_t[m_Slots];
+		m_Filled.assign((m_Slots + 63) / 64, 0);
+	}
+
+	Reset(m_BaseSeq);
+}
+
+void RdtReassemblyBuffer::Reset(uint32_t seq)
+{
+	std::fill(m_Filled.begin(), m_Filled.end(), 0);
+	std::fill(m_pFlags, m_pFlags + m_Slots, 0);
+	m_Head = 0;
+	m_BaseSeq = seq;
+	m_Stored = 0;
+	m_Ready = 0;
+	m_Unread = 0;
+	m_ReadyEnds = 0;
+	m_ReadIndex = 0;
+	m_ReadOffset = 0;
+	m_StreamCount = 0;
+}
+
+RdtReassemblyBuffer::EInsertResult RdtReassemblyBuffer::Insert(const RdtPacket &pkt)
+{
+	uint32_t seq = pkt.hdr.m_SeqNumber;
+	if(SeqBefore(seq, m_BaseSeq))
+	{
+		return EIR_DUPLICATE;
+	}
+
+	uint32_t offset = SeqDist(m_BaseSeq, seq);
+	uint32_t index = offset / RDT_SEGMENT;
+	if(offset % RDT_SEGMENT != 0 || index >= m_Slots ||
+	   pkt.hdr.m_MsgLen < sizeof(RdtHeader) || pkt.hdr.m_MsgLen > RDT_SEGMENT)
+	{
+		return EIR_REJECTED;
+	}
+
+	uint32_t slot = Slot(index);
+	if(IsFilled(slot))
+	{
+		return EIR_DUPLICATE;
+	}
+
+	uint16_t len = pkt.hdr.m_MsgLen - sizeof(RdtHeader);
+	const char *pPayload = &pkt.msg[sizeof(RdtHeader)];
+	uint8_t flags = (pkt.hdr.m_Flags & RdtHeader::FLAG_LAST) ? SF_END : 0;
+	RdtStreamHeader streamHdr;
+	Stream *pStream = nullptr;
+	if(pkt.hdr.m_Flags & RdtHeader::FLAG_STREAM)
+	{
+		if(len < sizeof(streamHdr))
+		{
+			return EIR_REJECTED;
+		}
+
+		memcpy(&streamHdr, pPayload, sizeof(streamHdr));
+		streamHdr.ntoh();
+		pPayload += sizeof(streamHdr);
+		len -= sizeof(streamHdr);
+		flags |= SF_STREAM;
+
+		// A previous packet still in the ring must sit on a slot of its own,
+		// and a new stream needs room in the table
+		if(streamHdr.m_PrevDist <= offset && streamHdr.m_PrevDist % RDT_SEGMENT != 0)
+		{
+			return EIR_REJECTED;
+		}
+
+		pStream = FindStream(streamHdr.m_Stream, true);
+		if(!pStream)
+		{
+			return EIR_REJECTED;
+		}
+	}
+
+	memcpy(Payload(slot), pPayload, len);
+	m_pLengths[slot] = len;
+	m_pFlags[slot] = (m_pFlags[slot] & SF_LINKED) | flags;
+	SetFilled(slot);
+	++m_Stored;
+
+	if(pStream)
+	{
+		m_pStreamIds[slot] = streamHdr.m_Stream;
+		AddToStream(pStream, streamHdr.m_PrevDist, index);
+	}
+
+	// Filling the first gap joins any run stored past it
+	if(index == m_Ready)
+	{
+		uint32_t end = FindSlot(m_Ready, false);
+		for(; m_Ready < end; ++m_Ready)
+		{
+			uint8_t runFlags = m_pFlags[Slot(m_Ready)];
+			if(!(runFlags & (SF_STREAM | SF_READ)))
+			{
+				++m_Unread;
+				m_ReadyEnds += runFlags & SF_END;
+			}
+		}
+	}
+	return EIR_STORED;
+}
+
+RdtReassemblyBuffer::Stream *RdtReassemblyBuffer::FindStream(uint32_t id, bool bCreate)
+{
+	for(uint32_t i = 0; i < m_StreamCount; ++i)
+	{
+		if(m_Streams[i].m_Id == id)
+		{
+			return &m_Streams[i];
+		}
+	}
+
+	if(!bCreate || m_StreamCount == RDT_MAX_STREAMS)
+	{
+		return nullptr;
+	}
+
+	Stream *pStream = &m_Streams[m_StreamCount++];
+	*pStream = Stream();
+	pStream->m_Id = id;
+	return pStream;
+}
+
+const RdtReassemblyBuffer::Stream *RdtReassemblyBuffer::FindStream(uint32_t id) const
+{
+	for(uint32_t i = 0; i < m_StreamCount; ++i)
+	{
+		if(m_Streams[i].m_Id == id)
+		{
+			return &m_Streams[i];
+		}
+	}
+
+	return nullptr;
+}
+
+void RdtReassemblyBuffer::AddToStream(Stream *pStream, uint32_t prevDist, uint32_t index)
+{
+	// The packet is ready once the stream's previous packet has been read or
+	// is ready itself, which a packet sent before the ring's start has been.
+	// Otherwise it waits for that packet, which it links to.
+	bool bReady = true;
+	if(prevDist != 0 && prevDist <= index * RDT_SEGMENT)
+	{
+		uint32_t prev = Slot(index - prevDist / RDT_SEGMENT);
+		m_pNext[prev] = prevDist / RDT_SEGMENT;
+		m_pFlags[prev] |= SF_LINKED;
+		bReady = IsFilled(prev) && (m_pFlags[prev] & (SF_READ | SF_READY));
+	}
+
+	if(!bReady)
+	{
+		++pStream->m_Pending;
+		return;
+	}
+
+	if(pStream->m_Ready == 0)
+	{
+		pStream->m_HeadSeq = m_BaseSeq + index * RDT_SEGMENT;
+	}
+
+	// Becoming ready brings along the packets already linked after it
+	uint32_t slot = Slot(index);
+	while(1)
+	{
+		m_pFlags[slot] |= SF_READY;
+		++pStream->m_Ready;
+		pStream->m_ReadyEnds += m_pFlags[slot] & SF_END;
+		if(!(m_pFlags[slot] & SF_LINKED))
+		{
+			break;
+		}
+
+		index += m_pNext[slot];
+		slot = Slot(index);
+		if(index >= m_Slots || !IsFilled(slot) || !(m_pFlags[slot] & SF_STREAM) ||
+		   (m_pFlags[slot] & SF_READY) || m_pStreamIds[slot] != pStream->m_Id)
+		{
+			break;
+		}
+		--pStream->m_Pending;
+	}
+}
+
+bool RdtReassemblyBuffer::HasStreamData(uint32_t stream) const
+{
+	const Stream *pStream = FindStream(stream);
+	return pStream && pStream->m_Ready > 0;
+}
+
+bool RdtReassemblyBuffer::HasStreamMessage(uint32_t stream) const
+{
+	const Stream *pStream = FindStream(stream);
+	return pStream && pStream->m_ReadyEnds > 0;
+}
+
+void RdtReassemblyBuffer::GetReadyStreams(std::vector<uint32_t> &streams) const
+{
+	streams.clear();
+	for(uint32_t i = 0; i < m_StreamCount; ++i)
+	{
+		if(m_Streams[i].m_Ready > 0)
+		{
+			streams.push_back(m_Streams[i].m_Id);
+		}
+	}
+}
+
+bool RdtReassemblyBuffer::Contains(uint32_t seq) const
+{
+	if(SeqBefore(seq, m_BaseSeq))
+	{
+		return true;
+	}
+
+	uint32_t offset = SeqDist(m_BaseSeq, seq);
+	uint32_t index = offset / RDT_SEGMENT;
+	if(offset % RDT_SEGMENT != 0 || index >= m_Slots)
+	{
+		return false;
+	}
+
+	return IsFilled(Slot(index));
+}
+
+int RdtReassemblyBuffer::GetBlocks(RdtSackBlock *pBlocks, int max) const
+{
+	int count = 0;
+	uint32_t index = m_Ready;
+	while(count < max && (index = FindSlot(index, true)) < m_Slots)
+	{
+		uint32_t end = FindSlot(index, false);
+		pBlocks[count].m_Start = m_BaseSeq + index * RDT_SEGMENT;
+		pBlocks[count].m_End = m_BaseSeq + end * RDT_SEGMENT;
+		++count;
+		index = end;
+	}
+
+	return count;
+}
+
+uint32_t RdtReassemblyBuffer::FindSlot(uint32_t index, bool bFilled) const
+{
+	// Skip whole words of the bitmap at a time
+	while(index < m_Slots)
+	{
+		uint32_t slot = Slot(index);
+		uint64_t word = m_Filled[slot / 64];
+		if(!bFilled){ word = ~word; }
+		word >>= slot % 64;
+
+		// Up to the end of the word, or of the ring if it wraps first
+		uint32_t span = std::min(64 - slot % 64, m_Slots - slot);
+		if(span < 64)
+		{
+			word &= ((uint64_t)1 << span) - 1;
+		}
+
+		if(word)
+		{
+			index += __builtin_ctzll(word);
+			return std::min(index, m_Slots);
+		}
+
+		index += span;
+	}
+
+	return m_Slots;
+}
+
+int RdtReassemblyBuffer::Gather(iovec *pIov, int max, bool bMessage, bool *pbEnd,
+								size_t *pTotal)
+{
+	// Consecutive slots are adjacent in memory unless the ring wraps or a
+	// packet was short
+	int count = 0;
+	*pbEnd = false;
+	*pTotal = 0;
+	uint16_t offset = m_ReadOffset;
+	uint32_t unread = m_Unread;
+	for(uint32_t index = m_ReadIndex; index < m_Ready && unread > 0; ++index)
+	{
+		uint32_t slot = Slot(index);
+		if(m_pFlags[slot] & (SF_STREAM | SF_READ))
+		{
+			continue;
+		}
+
+		--unread;
+		char *pPayload = Payload(slot) + offset;
+		size_t len = m_pLengths[slot] - offset;
+		offset = 0;
+
+		if(count > 0 && (char*)pIov[count-1].iov_base + pIov[count-1].iov_len == pPayload)
+		{
+			pIov[count-1].iov_len += len;
+		}
+		else if(count < max)
+		{
+			pIov[count].iov_base = pPayload;
+			pIov[count].iov_len = len;
+			++count;
+		}
+		else
+		{
+			break;
+		}
+
+		*pTotal += len;
+		if(bMessage && (m_pFlags[slot] & SF_END))
+		{
+			*pbEnd = true;
+			break;
+		}
+	}
+
+	return count;
+}
+
+bool RdtReassemblyBuffer::Consume(size_t bytes)
+{
+	bool bEnd = false;
+	if(m_Unread == 0)
+	{
+		return bEnd;
+	}
+
+	uint32_t index = m_ReadIndex;
+	do
+	{
+		uint32_t slot;
+		while((m_pFlags[slot = Slot(index)] & (SF_STREAM | SF_READ)))
+		{
+			++index;
+		}
+
+		uint16_t left = m_pLengths[slot] - m_ReadOffset;
+		if(bytes < left)
+		{
+			m_ReadOffset += bytes;
+			m_ReadIndex = index;
+			return false;
+		}
+
+		bytes -= left;
+		bEnd = m_pFlags[slot] & SF_END;
+		m_ReadyEnds -= bEnd;
+		m_pFlags[slot] |= SF_READ;
+		--m_Unread;
+		m_ReadOffset = 0;
+		++index;
+	} while(bytes > 0 && m_Unread > 0);
+
+	m_ReadIndex = index;
+	Advance();
+	return bEnd;
+}
+
+void RdtReassemblyBuffer::Advance()
+{
+	while(m_Ready > 0 && (m_pFlags[m_Head] & SF_READ))
+	{
+		ClearFilled(m_Head);
+		m_pFlags[m_Head] = 0;
+		--m_Stored;
+		--m_Ready;
+		m_BaseSeq += RDT_SEGMENT;
+		if(++m_Head == m_Slots){ m_Head = 0; }
+		if(m_ReadIndex > 0){ --m_ReadIndex; }
+	}
+}
+
+size_t RdtReassemblyBuffer::ReadStream(uint32_t id, const iovec *pIov, int count,
+									   bool bMessage, bool *pbEnd)
+{
+	*pbEnd = false;
+	Stream *pStream = FindStream(id, false);
+	if(!pStream)
+	{
+		return 0;
+	}
+
+	size_t copied = 0;
+	int iov = 0;
+	size_t iovOffset = 0;
+	bool bEnd = false;
+	while(pStream->m_Ready > 0 && !(bMessage && bEnd))
+	{
+		uint32_t slot = SlotOf(pStream->m_HeadSeq);
+		const char *pPayload = Payload(slot) + pStream->m_ReadOffset;
+		size_t left = m_pLengths[slot] - pStream->m_ReadOffset;
+
+		// Scatter the payload over the caller's buffers
+		size_t done = 0;
+		while(done < left && iov < count)
+		{
+			size_t len = std::min(left - done, pIov[iov].iov_len - iovOffset);
+			memcpy((char*)pIov[iov].iov_base + iovOffset, pPayload + done, len);
+			done += len;
+			iovOffset += len;
+			if(iovOffset == pIov[iov].iov_len)
+			{
+				++iov;
+				iovOffset = 0;
+			}
+		}
+
+		copied += done;
+		if(done < left)
+		{
+			// The caller's buffers are full
+			pStream->m_ReadOffset += done;
+			bEnd = false;
+			break;
+		}
+
+		// Packets ready after this one were all reached through its link
+		bEnd = m_pFlags[slot] & SF_END;
+		pStream->m_ReadyEnds -= bEnd;
+		pStream->m_ReadOffset = 0;
+		m_pFlags[slot] = (m_pFlags[slot] & ~SF_READY) | SF_READ;
+		if(--pStream->m_Ready > 0)
+		{
+			pStream->m_HeadSeq += m_pNext[slot] * RDT_SEGMENT;
+		}
+	}
+
+	// A drained stream gives up its entry; packets sent on it later find
+	// their previous packet read
+	if(pStream->m_Ready == 0 && pStream->m_Pending == 0 && pStream->m_ReadOffset == 0)
+	{
+		*pStream = m_Streams[--m_StreamCount];
+	}
+
+	Advance();
+	*pbEnd = bEnd;
+	return copied;
+}
+
+size_t RdtReassemblyBuffer::Read(const iovec *pIov, int count, bool bMessage, bool *pbEnd)
+{
+	size_t copied = 0;
+	int iov = 0;
+	size_t iovOffset = 0;
+	bool bEnd = false;
+	while(m_Unread > 0 && !bEnd)
+	{
+		iovec spans[RDT_REASM_MAX_IOV];
+		size_t total;
+		int spanCount = Gather(spans, RDT_REASM_MAX_IOV, bMessage, &bEnd, &total);
+
+		// Scatter the spans over the caller's buffers
+		size_t done = 0;
+		for(int i = 0; i < spanCount; ++i)
+		{
+			size_t spanOffset = 0;
+			while(spanOffset < spans[i].iov_len && iov < count)
+			{
+				size_t len = std::min(spans[i].iov_len - spanOffset,
+									  pIov[iov].iov_len - iovOffset);
+				memcpy((char*)pIov[iov].iov_base + iovOffset,
+					   (char*)spans[i].iov_base + spanOffset, len);
+				spanOffset += len;
+				iovOffset += len;
+				done += len;
+				if(iovOffset == pIov[iov].iov_len)
+				{
+					++iov;
+					iovOffset = 0;
+				}
+			}
+		}
+
+		Consume(done);
+		copied += done;
+
+		// The caller's buffers are full
+		if(done < total)
+		{
+			bEnd = false;
+			break;
+		}
+	}
+
+	*pbEnd = bEnd;
+	return copied;
+}
+
+int RdtReassemblyBuffer::Flush(int fd, bool *pbEnd)
+{
+	*pbEnd = false;
+	while(m_Unread > 0 && !*pbEnd)
+	{
+		iovec iov[RDT_REASM_MAX_IOV];
+		size_t total;
+		int count = Gather(iov, RDT_REASM_MAX_IOV, true, pbEnd, &total);
+
+		// Regular files only write short if the disk is full
+		if(total > 0 && writev(fd, iov, count) != (ssize_t)total)
+		{
+			return -1;
+		}
+
+		Consume(total);
+	}
+
+	return 0;
+}
+
+int RdtReassemblyBuffer::FlushAsync(RdtUring &uring, RdtUringWrite *pWrite, int fd,
+									bool *pbEnd)
+{
+	*pbEnd = false;
+	while(1)
+	{
+		if(pWrite->m_Length > 0)
+		{
+			if(pWrite->m_bPending && !uring.Reap(pWrite))
+			{
+				return 0;
+			}
+
+			// Regular files only write short if the disk is full
+			size_t written = pWrite->m_Length;
+			pWrite->m_Length = 0;
+			if(pWrite->m_Result != (int)written)
+			{
+				return -1;
+			}
+
+			if(Consume(written))
+			{
+				*pbEnd = true;
+				return 0;
+			}
+		}
+
+		if(m_Unread == 0)
+		{
+			return 0;
+		}
+
+		iovec iov[RDT_REASM_MAX_IOV];
+		size_t total;
+		bool bEnd;
+		int count = Gather(iov, RDT_REASM_MAX_IOV, true, &bEnd, &total);
+		if(total == 0)
+		{
+			// An empty message has nothing to write
+			if(Consume(0))
+			{
+				*pbEnd = true;
+				return 0;
+			}
+			continue;
+		}
+
+		if(uring.Write(pWrite, fd, iov, count) == -1)
+		{
+			return -1;
+		}
+	}
+}
@@ -0,0 +1,272 @@
+// File: rdt_reassembly.h
+// Description: Header containing the buffer that received data is put back
+//              in order in until the application reads it.
+
+#ifndef _RDT_REASSEMBLY_H_
+#define _RDT_REASSEMBLY_H_
+
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+#include "rdt_structures.h"
+#include "rdt_uring.h"
+
+#define RDT_REASM_MAX_IOV 16 // Spans handed to each writev() call
+
+/**
+ * @brief Fixed-size ring that data packets are reassembled in
+ *
+ * The ring covers the receive window in slots of one data packet each,
+ * starting at the first packet not yet read out. Every data packet takes up
+ * RDT_SEGMENT of sequence space however short it is, so a packet's slot
+ * follows directly from its distance past that, and storing a packet and
+ * rejecting duplicates or packets outside the window take constant time;
+ * which slots are filled is tracked in a bitmap. Payloads are laid out back
+ * to back, so the filled run at the front of the ring is written out with a
+ * single writev() call.
+ *
+ * Data is read out of the front of the ring a byte count at a time, and
+ * the slot of the last packet of a message (FLAG_LAST) marks where reads
+ * that keep message boundaries stop.
+ *
+ * Packets sent on a stream (FLAG_STREAM) share the ring, and with it the
+ * receive window, but are read out per stream: a stream's packet is ready
+ * once the stream's previous packet, which it names by its distance back,
+ * has been read or is ready itself, whatever gaps other streams have in
+ * between. A packet that arrives first links its predecessor's slot to its
+ * own, so the ready packets of a stream form a chain through the ring.
+ * Streams only take an entry of a fixed table while they have packets
+ * stored. Reads of the connection's own data pass over stream packets, and
+ * the front of the ring moves on once every packet there has been read, by
+ * whichever read.
+ */
+class RdtReassemblyBuffer
+{
+public:
+	enum EInsertResult
+	{
+		EIR_STORED,
+		EIR_DUPLICATE, // Already stored or read out
+		EIR_REJECTED   // Outside the window or not on a slot boundary
+	};
+
+	RdtReassemblyBuffer();
+	~RdtReassemblyBuffer();
+
+	RdtReassemblyBuffer(const RdtReassemblyBuffer&) = delete;
+	RdtReassemblyBuffer &operator=(const RdtReassemblyBuffer&) = delete;
+
+	/**
+	 * @brief Sizes the ring to hold window bytes of sequence space
+	 * @note Only reallocates if the number of slots changes
+	 */
+	void Initialize(uint32_t window);
+
+	/**
+	 * @brief Empties the ring and anchors it at seq
+	 */
+	void Reset(uint32_t seq);
+
+	/**
+	 * @brief Copies the payload of a data packet into its slot
+	 */
+	EInsertResult Insert(const RdtPacket &pkt);
+
+	/**
+	 * @brief Whether the packet at seq has already been stored or read out
+	 */
+	bool Contains(uint32_t seq) const;
+
+	/**
+	 * @brief Copies in-order data into the count buffers of pIov and moves
+	 *        the ring past it
+	 * @param bMessage Stop after the last packet of a message
+	 * @param pbEnd Set to whether the read ended a message
+	 * @return Bytes copied
+	 */
+	size_t Read(const iovec *pIov, int count, bool bMessage, bool *pbEnd);
+
+	/**
+	 * @brief Writes the in-order data up to the end of the next message to
+	 *        fd and moves the ring past it
+	 * @param pbEnd Set to whether the message was written out in full
+	 * @return 0 if successful, -1 if the write failed
+	 */
+	int Flush(int fd, bool *pbEnd);
+
+	/**
+	 * @brief Like Flush(), but writes through uring in the background
+	 *
+	 * The data being written keeps its slots until pWrite completes, which
+	 * later calls check for before starting the next write.
+	 *
+	 * @param pWrite Tracks the write in flight; zeroed before the first call
+	 * @param pbEnd Set to whether a message has been written out in full
+	 * @return 0 if successful, -1 if a write failed
+	 */
+	int FlushAsync(RdtUring &uring, RdtUringWrite *pWrite, int fd, bool *pbEnd);
+
+	/**
+	 * @brief Read() for the data of one stream
+	 */
+	size_t ReadStream(uint32_t stream, const iovec *pIov, int count, bool bMessage,
+					  bool *pbEnd);
+
+	/**
+	 * @brief Whether any in-order data (or an empty message) is waiting to
+	 *        be read
+	 */
+	bool HasData() const{ return m_Unread > 0; }
+
+	/**
+	 * @brief Whether the in-order data holds the end of a message, so that
+	 *        a whole message can be read
+	 */
+	bool HasMessage() const{ return m_ReadyEnds > 0; }
+
+	/**
+	 * @brief HasData() for the data of one stream
+	 */
+	bool HasStreamData(uint32_t stream) const;
+
+	/**
+	 * @brief HasMessage() for the data of one stream
+	 */
+	bool HasStreamMessage(uint32_t stream) const;
+
+	/**
+	 * @brief Fills streams with those that have data waiting to be read
+	 */
+	void GetReadyStreams(std::vector<uint32_t> &streams) const;
+
+	/**
+	 * @brief Sequence number of the first packet not yet read out in full
+	 */
+	uint32_t NextSeq() const{ return m_BaseSeq; }
+
+	/**
+	 * @brief Sequence number past the packets received in order
+	 */
+	uint32_t ReadyEnd() const{ return m_BaseSeq + m_Ready * RDT_SEGMENT; }
+
+	/**
+	 * @brief Sequence space past ReadyEnd() there is room for
+	 */
+	uint32_t Space() const{ return (m_Slots - m_Ready) * RDT_SEGMENT; }
+
+	/**
+	 * @brief Whether packets are stored past a gap
+	 */
+	bool HasGaps() const{ return m_Stored > m_Ready; }
+
+	/**
+	 * @brief Fills pBlocks with the runs of packets stored past a gap,
+	 *        closest first
+	 * @return Number of blocks filled, at most max
+	 */
+	int GetBlocks(RdtSackBlock *pBlocks, int max) const;
+
+private:
+	enum ESlotFlags
+	{
+		SF_END    = 0x1, // Ends a message
+		SF_STREAM = 0x2, // Holds stream data
+		SF_READ   = 0x4, // Read out, but behind an unread slot
+		SF_READY  = 0x8, // Stream data whose previous packets are all ready or read
+		SF_LINKED = 0x10 // m_pNext holds the stream's following packet, which
+		                 // may arrive before the slot is filled
+	};
+
+	/**
+	 * @brief Stream with packets stored in the ring
+	 */
+	struct Stream
+	{
+		Stream() : m_Id(0), m_HeadSeq(0), m_Ready(0), m_ReadyEnds(0), m_Pending(0),
+			m_ReadOffset(0){}
+
+		uint32_t m_Id;
+		uint32_t m_HeadSeq;    // First ready packet, if any
+		uint32_t m_Ready;      // Packets chained from m_HeadSeq ready to be read
+		uint32_t m_ReadyEnds;  // Packets among those that end a message
+		uint32_t m_Pending;    // Packets stored but waiting for an earlier one
+		uint16_t m_ReadOffset; // Payload bytes of m_HeadSeq already read out
+	};
+
+	bool IsFilled(uint32_t slot) const{ return (m_Filled[slot / 64] >> (slot % 64)) & 1; }
+	void SetFilled(uint32_t slot){ m_Filled[slot / 64] |= (uint64_t)1 << (slot % 64); }
+	void ClearFilled(uint32_t slot){ m_Filled[slot / 64] &= ~((uint64_t)1 << (slot % 64)); }
+	char *Payload(uint32_t slot){ return m_pData + (size_t)slot * RDT_MSS; }
+	uint32_t Slot(uint32_t index) const
+	{
+		uint32_t slot = m_Head + index;
+		return (slot >= m_Slots) ? slot - m_Slots : slot;
+	}
+	uint32_t SlotOf(uint32_t seq) const{ return Slot(SeqDist(m_BaseSeq, seq) / RDT_SEGMENT); }
+
+	/**
+	 * @brief Entry of the stream numbered id
+	 * @param bCreate Take a free entry if there is none
+	 * @return nullptr if there is none, or no free one
+	 */
+	Stream *FindStream(uint32_t id, bool bCreate);
+	const Stream *FindStream(uint32_t id) const;
+
+	/**
+	 * @brief Files the stream packet stored at index under pStream, marking
+	 *        it and any packets linked after it ready if they are
+	 * @param prevDist Sequence space back to the stream's previous packet
+	 */
+	void AddToStream(Stream *pStream, uint32_t prevDist, uint32_t index);
+
+	/**
+	 * @brief Moves the front of the ring past the slots read out
+	 */
+	void Advance();
+
+	/**
+	 * @brief First index at or after index whose slot is filled (or empty)
+	 * @return m_Slots if there is none
+	 */
+	uint32_t FindSlot(uint32_t index, bool bFilled) const;
+
+	/**
+	 * @brief Fills pIov with the in-order data, merging adjacent payloads
+	 * @param bMessage Stop after the last packet of a message
+	 * @param pbEnd Set to whether the spans end a message
+	 * @return Number of spans filled, at most max
+	 */
+	int Gather(iovec *pIov, int max, bool bMessage, bool *pbEnd, size_t *pTotal);
+
+	/**
+	 * @brief Moves the ring past bytes of in-order data, other than stream
+	 *        data
+	 *
+	 * A packet without payload is passed over when it is at the front, so
+	 * that reading nothing still consumes an empty message.
+	 *
+	 * @return Whether the bytes ended on the end of a message
+	 */
+	bool Consume(size_t bytes);
+
+private:
+	uint32_t m_Slots;
+	uint32_t m_Head;    // Slot holding m_BaseSeq
+	uint32_t m_BaseSeq;
+	uint32_t m_Stored;
+	uint32_t m_Ready;      // Filled slots in a row from m_Head
+	uint32_t m_Unread;     // Slots among those not holding stream data or read
+	uint32_t m_ReadyEnds;  // Slots among those unread ones that end a message
+	uint32_t m_ReadIndex;  // Index of the first of those unread ones, or before it
+	uint16_t m_ReadOffset; // Payload bytes of that slot already read out
+	char *m_pData;         // RDT_MSS bytes per slot
+	uint16_t *m_pLengths;  // Payload bytes held by each slot
+	uint8_t *m_pFlags;     // ESlotFlags of each slot, kept for empty ones too
+	uint32_t *m_pNext;     // Slots on to the next packet of the stream if SF_LINKED
+	uint32_t *m_pStreamIds; // Stream of each slot holding stream data
+	std::vector<uint64_t> m_Filled;
+	Stream m_Streams[RDT_MAX_STREAMS]; // First m_StreamCount in use
+	uint32_t m_StreamCount;
+};
+
+#endif //_RDT_REASSEMBLY_H_
@@ -0,0 +1,227 @@
+/* File: rdt_server.cpp
+ * Description: Implementation of the RdtServer class
+ */
+
+#include "rdt.h"
+#include <cerrno>
+#include <algorithm>
+#include <sched.h>
+#include <pthread.h>
+
+RdtServer::RdtServer() :
+	m_WorkerCount(0), m_bAffinity(true), m_Steering(ERS_HASH), m_bStop(false)
+{
+}
+
+RdtServer::~RdtServer()
+{
+	Stop();
+}
+
+void RdtServer::SetWorkers(int count)
+{
+	m_WorkerCount = std::max(count, 0);
+}
+
+void RdtServer::SetCpuAffinity(bool bEnable)
+{
+	m_bAffinity = bEnable;
+}
+
+void RdtServer::SetSteering(ERdtSteering steering)
+{
+	m_Steering = steering;
+}
+
+void RdtServer::SetListenerSetup(const std::function<void(RdtConnection&)> &setup)
+{
+	m_ListenerSetup = setup;
+}
+
+int RdtServer::Start(const sockaddr *address, socklen_t address_len, int backlog,
+	const std::function<void(RdtConnection&)> &onAccept)
+{
+	if(!m_Workers.empty() || !onAccept)
+	{
+		return -1;
+	}
+
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+	{
+		return -1;
+	}
+
+	std::vector<int> cpus;
+	for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if(CPU_ISSET(cpu, &allowed))
+		{
+			cpus.push_back(cpu);
+		}
+	}
+
+	int count = (m_WorkerCount > 0) ? m_WorkerCount : (int)cpus.size();
+	m_OnAccept = onAccept;
+
+	// Bind the sockets one at a time, since the order they join the reuseport
+	// group in is the index CPU steering picks them by
+	std::vector<int> workerCpus;
+	for(int i = 0; i < count; ++i)
+	{
+		Worker *pWorker = new Worker;
+		workerCpus.push_back(cpus[i % cpus.size()]);
+		pWorker->m_Cpu = m_bAffinity ? workerCpus.back() : -1;
+		m_Workers.push_back(pWorker);
+
+		std::promise<int> bound;
+		std::future<int> result = bound.get_future();
+		pWorker->m_Thread = std::thread(&RdtServer::Run, this, pWorker, address,
+			address_len, backlog, &bound);
+		if(result.get() == -1)
+		{
+			Stop();
+			return -1;
+		}
+	}
+
+	if(m_Steering == ERS_CPU && m_Workers[0]->m_Listener.SetCpuSteering(workerCpus) == -1)
+	{
+		Stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+void RdtServer::Stop()
+{
+	m_bStop = true;
+	for(Worker *pWorker : m_Workers)
+	{
+		pWorker->m_Loop.Notify();
+	}
+
+	for(Worker *pWorker : m_Workers)
+	{
+		if(pWorker->m_Thread.joinable())
+		{
+			pWorker->m_Thread.join();
+		}
+		delete pWorker;
+	}
+
+	m_Workers.clear();
+	m_bStop = false;
+}
+
+int RdtServer::Listen(Worker *pWorker, const sockaddr *address, socklen_t address_len, int backlog)
+{
+	if(pWorker->m_Cpu != -1)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(pWorker->m_Cpu, &set);
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(error != 0)
+		{
+			errno = error;
+			return -1;
+		}
+	}
+
+	RdtConnection &listener = pWorker->m_Listener;
+	listener.SetEventLoop(&pWorker->m_Loop);
+	listener.SetPacketPool(&pWorker->m_Pool);
+	if(m_ListenerSetup)
+	{
+		m_ListenerSetup(listener);
+	}
+
+	if(listener.Initialize() == -1 || listener.SetReusePort(true) == -1)
+	{
+		return -1;
+	}
+
+	if(listener.Bind(address, address_len) == -1)
+	{
+		ERROR(ERR_BIND, false);
+		return -1;
+	}
+
+	if(listener.Listen(backlog) == -1)
+	{
+		ERROR(ERR_LISTEN, false);
+		return -1;
+	}
+
+	RdtCallbacks callbacks;
+	callbacks.m_OnConnect = [this, pWorker](RdtConnection&){ AcceptAll(pWorker); };
+	listener.SetNonBlocking(true);
+	listener.SetCallbacks(callbacks);
+	return 0;
+}
+
+void RdtServer::AcceptAll(Worker *pWorker)
+{
+	while(1)
+	{
+		RdtConnection *pConn = new RdtConnection;
+		pConn->SetEventLoop(&pWorker->m_Loop);
+		pConn->SetPacketPool(&pWorker->m_Pool);
+		pConn->SetNonBlocking(true);
+		if(pWorker->m_Listener.Accept(*pConn, nullptr, 0) == -1)
+		{
+			delete pConn;
+			return;
+		}
+
+		pWorker->m_Connections.push_back(pConn);
+		m_OnAccept(*pConn);
+	}
+}
+
+void RdtServer::Run(Worker *pWorker, const sockaddr *address, socklen_t address_len,
+	int backlog, std::promise<int> *pBound)
+{
+	// The listener is set up here rather than by Start(), so that an io_uring
+	// it uses completes its work on this thread's CPU
+	int result = Listen(pWorker, address, address_len, backlog);
+	pBound->set_value(result);
+	if(result == -1)
+	{
+		return;
+	}
+
+	std::vector<RdtConnection*> &conns = pWorker->m_Connections;
+	while(!m_bStop)
+	{
+		// Connections share the loop, so every one of them is processed on
+		// each wakeup
+		if(pWorker->m_Loop.Wait(pWorker->m_Loop.Timers().NextDeadline()) == -1 ||
+			pWorker->m_Listener.Process() == -1)
+		{
+			break;
+		}
+
+		for(size_t i = 0; i < conns.size();)
+		{
+			RdtConnection *pConn = conns[i];
+			if(pConn->Process() == -1 || pConn->IsClosed())
+			{
+				delete pConn;
+				conns[i] = conns.back();
+				conns.pop_back();
+				continue;
+			}
+			++i;
+		}
+	}
+
+	for(RdtConnection *pConn : conns)
+	{
+		delete pConn;
+	}
+	conns.clear();
+	pWorker->m_Listener.Shutdown();
+}
@@ -7,29 +7,83 @@
 
 #include <cstdint>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
 
 template<int N, int M> struct DIV{ enum{ val = N/M }; };
 template<int N, int M> struct MULT{ enum{ val = N * M }; };
 
-#define RDT_MAX_SEQNUM 30720 // Sequence numbers are in bytes
-#define RDT_HALF_SEQSIZE DIV<RDT_MAX_SEQNUM,2>::val
-#define RDT_WNDSIZE 5120 // Window size defined in bytes
-#define RDT_RTO_MS 500 // Defined in ms
-#define RDT_RTO_CLK DIV<MULT<RDT_RTO_MS,CLOCKS_PER_SEC>::val, 1000>::val
+#define RDT_WNDSIZE 5120 // Initial window size defined in bytes
+#define RDT_MAX_WNDSIZE (32 << 20) // Far below the 2^31 bytes SeqBefore() resolves
+#define RDT_MAX_UNACKED (MULT<RDT_MAX_WNDSIZE,2>::val / RDT_MSS) // Unacked packets tracked
+#define RDT_RTO_MS 500 // Initial RTO before any RTT is measured, in ms
+#define RDT_MIN_RTO_MS 5
+#define RDT_MAX_RTO_MS 60000
+#define RDT_NS_PER_MS ((uint64_t)1000000)
+#define RDT_TS_SHIFT 10 // Header timestamps count units of 2^10 ns (~1 us)
 #define RDT_MAX_PKTSIZE 1024
 #define RDT_MSS (RDT_MAX_PKTSIZE - sizeof(RdtHeader) - 1)
+#define RDT_SEGMENT (RDT_MSS + sizeof(RdtHeader)) // Sequence space of a full data packet
 #define RDT_MAX_CONNECTIONS 64
+#define RDT_MAX_STREAMS 64 // Streams a connection can have packets buffered on at once
+#define RDT_WORKER_POOL (4 * (RDT_MAX_UNACKED + RDT_SEND_QUEUE)) // Packets an RdtServer worker's connections share
+#define RDT_INBOUND_QUEUE 256 // Packets buffered per connection by the demuxer
+#define RDT_SEND_QUEUE 1024 // Packets written but not yet let out by the windows
+#define RDT_IO_BATCH 32 // Datagrams moved per sendmmsg/recvmmsg call
+#define RDT_GRO_BATCH 4 // Aggregates per recvmmsg call, kept within RDT_INBOUND_QUEUE
+#define RDT_GRO_BUFSIZE 65536 // Largest aggregate UDP_GRO can return
+#define RDT_ECN_MASK 0x3 // ECN field of the IP TOS byte
+#define RDT_ECN_ECT0 0x2 // ECN-capable transport, marked on everything we send
+#define RDT_ECN_CE 0x3   // Congestion experienced, set by routers
+#define RDT_MAX_SACK_BLOCKS 32 // Received ranges reported past the cumulative ACK
+#define RDT_REORDER_THRESH 3 // Full packets ACKed past an unacked one before it is deemed lost
+#define RDT_ACK_EVERY 16 // Default data packets covered by a single ACK
+#define RDT_ACK_DELAY_US 0 // Default longest an ACK is held, 0 to end with the batch
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/**
+ * @brief Rounds i up to the next power of two
+ */
+inline uint32_t RdtPow2(uint32_t i)
+{
+	uint32_t size = 1;
+	while(size < i){ size <<= 1; }
+	return size;
+}
+
+/**
+ * @brief FIFO queue holding up to Initialize()'s size minus one elements
+ *
+ * Storage is rounded up to a power of two, so the free-running read and write
+ * counters only need masking, and their difference is the size even after
+ * they wrap around.
+ */
 template<typename T>
 class CircularBuffer
 {
 public:
-	CircularBuffer() : m_Size(0), m_ReadIndex(0), m_WriteIndex(0),
+	CircularBuffer() : m_Capacity(0), m_Mask(0), m_ReadIndex(0), m_WriteIndex(0),
 							m_pData(nullptr){}
 	~CircularBuffer(){ Shutdown(); }
 
-	void Initialize(int i){ assert(i > 0); m_Size = i; m_pData = new T[m_Size]; }
+	void Initialize(int i)
+	{
+		assert(i > 0);
+		Shutdown();
+		m_Capacity = i - 1;
+		m_Mask = RdtPow2(i) - 1;
+		m_pData = new T[m_Mask + 1];
+	}
+
 	void Shutdown()
 	{
 		if(m_pData)
@@ -43,30 +97,41 @@ public:
 
 	bool Push(const T &elem, int *pIndex=nullptr)
 	{
-		if(abs(m_ReadIndex - m_WriteIndex) >= m_Size-1){ return false; }
-		m_pData[m_WriteIndex] = elem;
-		if(pIndex){ *pIndex = m_WriteIndex; }
-		m_WriteIndex = (m_WriteIndex+1) % m_Size;
+		if(IsFull()){ return false; }
+		m_pData[m_WriteIndex & m_Mask] = elem;
+		if(pIndex){ *pIndex = m_WriteIndex & m_Mask; }
+		++m_WriteIndex;
 		return true;
 	}
 
 	bool Pop(T *pElem)
 	{
 		if(m_ReadIndex == m_WriteIndex){ return false; }
-		if(pElem){ *pElem = m_pData[m_ReadIndex]; }
-		m_ReadIndex = (m_ReadIndex+1) % m_Size;
+		if(pElem){ *pElem = m_pData[m_ReadIndex & m_Mask]; }
+		++m_ReadIndex;
+		return true;
+	}
+
+	/**
+	 * @brief Takes back the element pushed last
+	 */
+	bool PopBack(T *pElem)
+	{
+		if(m_ReadIndex == m_WriteIndex){ return false; }
+		--m_WriteIndex;
+		if(pElem){ *pElem = m_pData[m_WriteIndex & m_Mask]; }
 		return true;
 	}
 
-	size_t Size() const{ return abs(m_ReadIndex - m_WriteIndex); }
+	size_t Size() const{ return m_WriteIndex - m_ReadIndex; }
 
-	bool IsFull() const{ return Size() >= m_Size-1; }
+	bool IsFull() const{ return Size() >= m_Capacity; }
 
 	void Clear(){ m_WriteIndex = m_ReadIndex; }
 
 	T *operator[](int index)
 	{
-		if((unsigned)index >= (unsigned)m_Size)
+		if(!m_pData || (unsigned)index > m_Mask)
 		{
 			return nullptr;
 		}
@@ -75,19 +140,56 @@ public:
 	}
 
 	T *Peek()
-    {
+	{
 		if(m_ReadIndex == m_WriteIndex){ return nullptr; }
 
-		return &m_pData[m_ReadIndex];
+		return &m_pData[m_ReadIndex & m_Mask];
 	}
 
 private:
-	int m_Size;
-	int m_ReadIndex;
-	int m_WriteIndex;
+	uint32_t m_Capacity;
+	uint32_t m_Mask;
+	uint32_t m_ReadIndex;  // Free-running; masked to index m_pData
+	uint32_t m_WriteIndex;
 	T *m_pData;
 };
 
+/**
+ * @brief Key identifying a remote endpoint in a connection table
+ */
+struct PeerKey
+{
+	PeerKey() : m_Addr(0), m_Port(0){}
+	explicit PeerKey(const sockaddr &addr)
+	{
+		const sockaddr_in &in = reinterpret_cast<const sockaddr_in&>(addr);
+		m_Addr = in.sin_addr.s_addr;
+		m_Port = in.sin_port;
+	}
+
+	bool operator==(const PeerKey &other) const
+	{
+		return m_Addr == other.m_Addr && m_Port == other.m_Port;
+	}
+
+	uint32_t m_Addr;
+	uint16_t m_Port;
+};
+
+struct PeerKeyHash
+{
+	size_t operator()(const PeerKey &key) const
+	{
+		// Mix address and port so that clients behind one NAT still spread
+		// evenly over the buckets
+		uint64_t h = ((uint64_t)key.m_Addr << 16) | key.m_Port;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return (size_t)h;
+	}
+};
+
 struct PendingConnection
 {
 	sockaddr addr;
@@ -110,8 +212,8 @@ struct SendQueueElem
  */
 struct RdtHeader
 {
-	uint16_t m_SeqNumber;
-	uint16_t m_Reserved;
+	uint32_t m_SeqNumber; // Byte offset, wrapping around at 2^32
+	uint32_t m_Timestamp; // Send time, or the echoed send time in ACKs
 
 	uint16_t m_MsgLen;
 	uint16_t m_Flags;
@@ -124,8 +226,72 @@ struct RdtHeader
 		FLAG_RQST  =  0x8,
 		FLAG_FIRST =  0x10,
 		FLAG_LAST  =  0x20,
+		FLAG_CE    =  0x40, // Never sent; set on packets that arrived CE-marked
+		FLAG_STREAM = 0x80, // Data whose payload starts with an RdtStreamHeader
 	};
 
+	/**
+	 * @brief Sequence space the packet takes up
+	 *
+	 * Data packets always take up a full segment, however short, so that
+	 * each one maps straight onto a slot of the receiver's reassembly ring.
+	 */
+	uint32_t SeqSpace() const
+	{
+		return (m_Flags & ~(FLAG_FIRST | FLAG_LAST | FLAG_STREAM)) ? m_MsgLen : RDT_SEGMENT;
+	}
+
+	void ntoh();
+	void hton();
+};
+
+/**
+ * @brief Start of the payload of a data packet sent on a stream (FLAG_STREAM)
+ *
+ * Each packet names the stream's previous packet by how far back it was
+ * sent, so the receiver can tell once every earlier packet of the stream has
+ * arrived without waiting on packets of other streams sent in between.
+ */
+struct RdtStreamHeader
+{
+	uint32_t m_Stream;
+	uint32_t m_PrevDist; // Sequence space back to the stream's previous packet, 0 if none
+
+	void ntoh();
+	void hton();
+};
+
+#define RDT_STREAM_MSS (RDT_MSS - sizeof(RdtStreamHeader)) // Stream data carried per packet
+
+/**
+ * @brief Body of ACK packets, advertising the receiver's flow-control window
+ *
+ * The receiver buffers sequence numbers in [m_CumAck, m_CumAck + m_RecvWnd)
+ * and drops anything past that without acknowledging it. m_CeCount only ever
+ * grows, so the sender can tell new congestion marks from ones already seen
+ * even if ACKs are lost or reordered.
+ */
+struct RdtAckInfo
+{
+	uint32_t m_CumAck;  // Next in-order sequence number the receiver expects
+	uint32_t m_RecvWnd; // Bytes past m_CumAck the receiver will buffer
+	uint32_t m_CeCount; // Data packets the receiver got with a CE mark so far
+
+	void ntoh();
+	void hton();
+};
+
+/**
+ * @brief Range of sequence numbers received past the cumulative ACK
+ *
+ * Up to RDT_MAX_SACK_BLOCKS of these follow the RdtAckInfo of an ACK, in
+ * increasing order; their number follows from the ACK's length.
+ */
+struct RdtSackBlock
+{
+	uint32_t m_Start;
+	uint32_t m_End; // One past the last sequence number received
+
 	void ntoh();
 	void hton();
 };
@@ -139,12 +305,174 @@ struct RdtPacket
 	};
 };
 
-struct UnackedPacket
+/**
+ * @brief Buffers and message headers for a single sendmmsg or recvmmsg call
+ *
+ * Every slot owns a buffer of bufSize bytes, a pair of iovecs (the first
+ * pointing at the buffer), an address and room for one control message.
+ * Packets are held in network byte order.
+ *
+ * When sending, slots hold one packet each: its header, and either its body or
+ * an iovec referencing the body in place. A message may span several slots'
+ * iovecs, so runs of equally sized packets can be handed to the kernel as a
+ * single UDP_SEGMENT (GSO) buffer. When receiving, each message uses its own
+ * slot, which is sized to hold a whole UDP_GRO aggregate if needed.
+ */
+class RdtIoBatch
+{
+public:
+	RdtIoBatch(int slots, size_t bufSize) :
+		m_Slots(slots), m_BufSize(bufSize), m_Count(0)
+	{
+		m_pMsgs = new mmsghdr[m_Slots];
+		m_pIov = new iovec[m_Slots * IOV_PER_SLOT];
+		m_pAddrs = new sockaddr[m_Slots];
+		m_pControl = new char[m_Slots * CONTROL_SIZE];
+		m_pBuffer = new char[m_Slots * m_BufSize];
+
+		memset(m_pMsgs, 0, m_Slots * sizeof(mmsghdr));
+		memset(m_pIov, 0, m_Slots * IOV_PER_SLOT * sizeof(iovec));
+		for(int i = 0; i < m_Slots; ++i)
+		{
+			Iov(i)[0].iov_base = Buffer(i);
+			Iov(i)[0].iov_len = m_BufSize;
+		}
+	}
+
+	~RdtIoBatch()
+	{
+		delete[] m_pMsgs;
+		delete[] m_pIov;
+		delete[] m_pAddrs;
+		delete[] m_pControl;
+		delete[] m_pBuffer;
+	}
+
+	RdtIoBatch(const RdtIoBatch&) = delete;
+	RdtIoBatch &operator=(const RdtIoBatch&) = delete;
+
+	char *Buffer(int i){ return m_pBuffer + i * m_BufSize; }
+	char *Control(int i){ return m_pControl + i * CONTROL_SIZE; }
+
+	// The slot's own buffer, then a payload referenced in place (if any)
+	iovec *Iov(int i){ return m_pIov + i * IOV_PER_SLOT; }
+	size_t Length(int i){ return Iov(i)[0].iov_len + Iov(i)[1].iov_len; }
+
+	enum
+	{
+		CONTROL_SIZE = 2 * CMSG_SPACE(sizeof(int)), // UDP_GRO and IP_TOS
+		IOV_PER_SLOT = 2
+	};
+
+	int m_Slots;
+	size_t m_BufSize;
+	int m_Count; // Slots in use
+	mmsghdr *m_pMsgs;
+	iovec *m_pIov;
+	sockaddr *m_pAddrs;
+	char *m_pControl;
+	char *m_pBuffer;
+};
+
+/**
+ * @brief Distance from sequence number a forward to sequence number b
+ */
+inline uint32_t SeqDist(uint32_t a, uint32_t b)
+{
+	return b - a;
+}
+
+/**
+ * @brief Whether sequence number a comes before b, in serial number
+ *        arithmetic (RFC 1982)
+ * @note Assumes the two are less than 2^31 bytes apart, which holds since
+ *       windows are capped at RDT_MAX_WNDSIZE
+ */
+inline bool SeqBefore(uint32_t a, uint32_t b)
 {
-	UnackedPacket() : m_ResendTime(0), m_pNext(nullptr), m_pPacket(nullptr){}
-	clock_t m_ResendTime;
-	UnackedPacket *m_pNext;
-	RdtPacket *m_pPacket;  // Points to packet if unacked, otherwise is nullptr
+	return (int32_t)(a - b) < 0;
+}
+
+/**
+ * @brief Truncates a monotonic time to the 32-bit header timestamp format
+ */
+inline uint32_t RdtTimestamp(uint64_t now)
+{
+	return (uint32_t)(now >> RDT_TS_SHIFT);
+}
+
+/**
+ * @brief Time elapsed since a header timestamp was taken, in ns
+ * @note Only meaningful for ages below the ~73 minute wraparound period
+ */
+inline uint64_t RdtTimestampAge(uint32_t ts, uint64_t now)
+{
+	return (uint64_t)(uint32_t)(RdtTimestamp(now) - ts) << RDT_TS_SHIFT;
+}
+
+/**
+ * @brief Derives the retransmission timeout from measured round trip times
+ *
+ * Follows RFC 6298: the smoothed RTT and RTT variance are updated from each
+ * sample, and the RTO doubles on timeouts until the next sample arrives.
+ */
+class RttEstimator
+{
+public:
+	RttEstimator() : m_bHasSample(false), m_Srtt(0), m_RttVar(0), m_MinRtt(0),
+					 m_Rto(RDT_RTO_MS * RDT_NS_PER_MS), m_Backoff(0),
+					 m_LastBackoff(0){}
+
+	void Sample(uint64_t rtt)
+	{
+		if(!m_bHasSample)
+		{
+			m_bHasSample = true;
+			m_Srtt = rtt;
+			m_RttVar = rtt / 2;
+		}
+		else
+		{
+			uint64_t err = (rtt > m_Srtt) ? rtt - m_Srtt : m_Srtt - rtt;
+			m_RttVar = (3 * m_RttVar + err) / 4;
+			m_Srtt = (7 * m_Srtt + rtt) / 8;
+		}
+		m_MinRtt = m_MinRtt ? std::min(m_MinRtt, rtt) : rtt;
+
+		// Timestamps only resolve multiples of 2^RDT_TS_SHIFT ns
+		uint64_t var = std::max(4 * m_RttVar, (uint64_t)1 << RDT_TS_SHIFT);
+		m_Rto = std::min(std::max(m_Srtt + var, RDT_MIN_RTO_MS * RDT_NS_PER_MS),
+						 RDT_MAX_RTO_MS * RDT_NS_PER_MS);
+		m_Backoff = 0;
+	}
+
+	void OnTimeout(uint64_t now)
+	{
+		// Every packet lost in a burst times out separately, so only back off
+		// once per RTO
+		if(now >= m_LastBackoff + Rto() && m_Backoff < 16)
+		{
+			++m_Backoff;
+			m_LastBackoff = now;
+		}
+	}
+
+	uint64_t Rto() const
+	{
+		return std::min(m_Rto << m_Backoff, RDT_MAX_RTO_MS * RDT_NS_PER_MS);
+	}
+
+	uint64_t Srtt() const{ return m_Srtt; }
+	uint64_t MinRtt() const{ return m_MinRtt; }
+
+private:
+	bool m_bHasSample;
+	uint64_t m_Srtt;
+	uint64_t m_RttVar;
+	uint64_t m_MinRtt;
+	uint64_t m_Rto;
+	int m_Backoff;
+	uint64_t m_LastBackoff;
 };
 
 #endif //_RDT_STRUCTURES_H_
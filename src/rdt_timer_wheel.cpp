@@ -0,0 +1,218 @@
+/* File: rdt_timer_wheel.cpp
+ * Description: Implementation of the RdtTimerWheel class
+ */
+
+#include "rdt_timer_wheel.h"
+#include "rdt_event_loop.h"
+#include <algorithm>
+
+RdtTimerWheel::RdtTimerWheel() :
+	m_Tick(RdtNow() >> RDT_TIMER_TICK_SHIFT), m_pExpired(nullptr), m_Count(0)
+{
+	std::fill(&m_pSlots[0][0], &m_pSlots[0][0] + LEVELS * SLOTS, nullptr);
+	std::fill(m_Occupied, m_Occupied + LEVELS, 0);
+}
+
+RdtTimerWheel::~RdtTimerWheel()
+{
+}
+
+void RdtTimerWheel::Schedule(RdtTimer *pTimer, uint64_t deadline)
+{
+	Cancel(pTimer);
+
+	// An idle wheel may have fallen behind, which would only cost extra
+	// cascading once the timer is placed
+	if(m_Count == 0)
+	{
+		m_Tick = std::max(m_Tick, RdtNow() >> RDT_TIMER_TICK_SHIFT);
+	}
+
+	pTimer->m_Deadline = deadline;
+	Place(pTimer);
+	++m_Count;
+}
+
+void RdtTimerWheel::Cancel(RdtTimer *pTimer)
+{
+	if(!pTimer->IsScheduled())
+	{
+		return;
+	}
+
+	RdtTimer **ppHead = Head(pTimer->m_Level, pTimer->m_Slot);
+	if(pTimer->m_pPrev){ pTimer->m_pPrev->m_pNext = pTimer->m_pNext; }
+	else{ *ppHead = pTimer->m_pNext; }
+	if(pTimer->m_pNext){ pTimer->m_pNext->m_pPrev = pTimer->m_pPrev; }
+
+	if(*ppHead == nullptr && pTimer->m_Level != LEVEL_EXPIRED)
+	{
+		m_Occupied[pTimer->m_Level] &= ~((uint64_t)1 << pTimer->m_Slot);
+	}
+
+	pTimer->m_pPrev = pTimer->m_pNext = nullptr;
+	pTimer->m_Level = -1;
+	--m_Count;
+}
+
+RdtTimer *RdtTimerWheel::Expire(uint64_t now)
+{
+	if(!m_pExpired)
+	{
+		Advance(now);
+	}
+
+	RdtTimer *pTimer = m_pExpired;
+	if(pTimer)
+	{
+		Cancel(pTimer);
+	}
+
+	return pTimer;
+}
+
+uint64_t RdtTimerWheel::NextDeadline() const
+{
+	if(m_pExpired)
+	{
+		return (m_Tick - 1) << RDT_TIMER_TICK_SHIFT;
+	}
+
+	uint64_t tick;
+	return NextTick(&tick) ? tick << RDT_TIMER_TICK_SHIFT : 0;
+}
+
+void RdtTimerWheel::Place(RdtTimer *pTimer)
+{
+	// Timers further out than the wheel spans wait at the end of the current
+	// top-level rotation, and are placed again from there
+	uint64_t span = ((uint64_t)1 << (LEVELS * SLOT_BITS)) - 1;
+	uint64_t tick = std::min(std::max(ExpiryTick(pTimer), m_Tick), m_Tick | span);
+
+	// The level is the one holding the highest bit in which the expiry tick
+	// differs from the current one
+	uint64_t diff = tick ^ m_Tick;
+	int level = 0;
+	while(level < LEVELS - 1 && (diff >> ((level + 1) * SLOT_BITS)) != 0)
+	{
+		++level;
+	}
+
+	Link(pTimer, level, (tick >> (level * SLOT_BITS)) & SLOT_MASK);
+}
+
+void RdtTimerWheel::Link(RdtTimer *pTimer, int level, int slot)
+{
+	RdtTimer **ppHead = Head(level, slot);
+	pTimer->m_Level = level;
+	pTimer->m_Slot = slot;
+	pTimer->m_pPrev = nullptr;
+	pTimer->m_pNext = *ppHead;
+	if(*ppHead){ (*ppHead)->m_pPrev = pTimer; }
+	*ppHead = pTimer;
+
+	if(level != LEVEL_EXPIRED)
+	{
+		m_Occupied[level] |= (uint64_t)1 << slot;
+	}
+}
+
+RdtTimer *RdtTimerWheel::Detach(int level, int slot)
+{
+	RdtTimer *pList = m_pSlots[level][slot];
+	m_pSlots[level][slot] = nullptr;
+	m_Occupied[level] &= ~((uint64_t)1 << slot);
+
+	for(RdtTimer *pTimer = pList; pTimer; pTimer = pTimer->m_pNext)
+	{
+		pTimer->m_Level = -1;
+	}
+
+	return pList;
+}
+
+bool RdtTimerWheel::NextTick(uint64_t *pTick) const
+{
+	// Every timer lies ahead of the current tick, so each level's next
+	// occupied slot is found at or after the slot the current tick is in
+	bool bFound = false;
+	for(int level = 0; level < LEVELS; ++level)
+	{
+		int shift = level * SLOT_BITS;
+		int index = (m_Tick >> shift) & SLOT_MASK;
+		uint64_t pending = m_Occupied[level] & (~(uint64_t)0 << index);
+		if(!pending)
+		{
+			continue;
+		}
+
+		uint64_t rotation = m_Tick >> (shift + SLOT_BITS) << (shift + SLOT_BITS);
+		uint64_t tick = rotation + ((uint64_t)__builtin_ctzll(pending) << shift);
+		if(!bFound || tick < *pTick)
+		{
+			*pTick = tick;
+			bFound = true;
+		}
+	}
+
+	return bFound;
+}
+
+void RdtTimerWheel::Advance(uint64_t now)
+{
+	uint64_t target = now >> RDT_TIMER_TICK_SHIFT;
+	uint64_t tick;
+	while(NextTick(&tick) && tick <= target)
+	{
+		m_Tick = tick;
+
+		// Move timers down from every level whose slot begins at this tick,
+		// top down so they can fall through several levels
+		for(int level = LEVELS - 1; level > 0; --level)
+		{
+			int shift = level * SLOT_BITS;
+			if(tick & (((uint64_t)1 << shift) - 1))
+			{
+				continue;
+			}
+
+			RdtTimer *pTimer = Detach(level, (tick >> shift) & SLOT_MASK);
+			while(pTimer)
+			{
+				RdtTimer *pNext = pTimer->m_pNext;
+				Place(pTimer);
+				pTimer = pNext;
+			}
+		}
+
+		// Everything now in this tick's slot has expired, except timers that
+		// were parked at the end of a rotation
+		RdtTimer *pTimer = Detach(0, tick & SLOT_MASK);
+		m_Tick = tick + 1;
+		while(pTimer)
+		{
+			RdtTimer *pNext = pTimer->m_pNext;
+			if(ExpiryTick(pTimer) <= tick)
+			{
+				Link(pTimer, LEVEL_EXPIRED, 0);
+			}
+			else
+			{
+				Place(pTimer);
+			}
+			pTimer = pNext;
+		}
+	}
+
+	m_Tick = std::max(m_Tick, target + 1);
+}
+
+RdtTimer **RdtTimerWheel::Head(int level, int slot)
+{
+	return (level == LEVEL_EXPIRED) ? &m_pExpired : &m_pSlots[level][slot];
+}
+
+uint64_t RdtTimerWheel::ExpiryTick(const RdtTimer *pTimer)
+{
+	return (pTimer->m_Deadline + ((uint64_t)1 << RDT_TIMER_TICK_SHIFT) - 1) >> RDT_TIMER_TICK_SHIFT;
+}
@@ -0,0 +1,109 @@
+// File: rdt_timer_wheel.h
+// Description: Header containing the timer wheel that schedules the
+//              retransmissions of every connection sharing an event loop.
+
+#ifndef _RDT_TIMER_WHEEL_H_
+#define _RDT_TIMER_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#define RDT_TIMER_TICK_SHIFT 16 // Wheel ticks are 2^16 ns (~66 us) long
+
+/**
+ * @brief Intrusive timer, embedded in whatever it schedules
+ *
+ * Only the wheel may touch the bookkeeping members, and a timer must not be
+ * copied or destroyed while it is scheduled.
+ */
+struct RdtTimer
+{
+	RdtTimer() : m_Deadline(0), m_pOwner(nullptr), m_pPrev(nullptr),
+				 m_pNext(nullptr), m_Level(-1), m_Slot(0){}
+
+	bool IsScheduled() const{ return m_Level != -1; }
+
+	uint64_t m_Deadline; // RdtNow() time to expire at
+	void *m_pOwner;      // Set by whoever schedules the timer
+
+	RdtTimer *m_pPrev;
+	RdtTimer *m_pNext;
+	int8_t m_Level; // Wheel level the timer is linked into, -1 if none
+	uint8_t m_Slot;
+};
+
+/**
+ * @brief Hierarchical timer wheel (Varghese & Lauck)
+ *
+ * Each level is a ring of 64 slots, each slot covering 64 times as much time
+ * as a slot of the level below; four levels span about 18 minutes of ticks,
+ * which comfortably holds the largest RTO. Timers are linked into the slot
+ * their deadline falls in, and are moved down a level as the wheel reaches
+ * their slot, so scheduling and cancelling take constant time and expiring
+ * takes constant time per timer. Per-level bitmaps of occupied slots let the
+ * wheel jump straight to the next tick with work to do.
+ *
+ * Timers expire on the first tick boundary at or after their deadline. The
+ * wheel is not thread-safe; connections sharing it must share a thread, as
+ * they must when sharing an event loop.
+ */
+class RdtTimerWheel
+{
+public:
+	RdtTimerWheel();
+	~RdtTimerWheel();
+
+	RdtTimerWheel(const RdtTimerWheel&) = delete;
+	RdtTimerWheel &operator=(const RdtTimerWheel&) = delete;
+
+	/**
+	 * @brief Schedules pTimer to expire at deadline, rescheduling it if it
+	 *        was already scheduled
+	 */
+	void Schedule(RdtTimer *pTimer, uint64_t deadline);
+
+	/**
+	 * @brief Unschedules pTimer, if scheduled
+	 */
+	void Cancel(RdtTimer *pTimer);
+
+	/**
+	 * @brief Takes the next timer whose deadline is no later than now
+	 * @return The timer, which is no longer scheduled, or nullptr if none
+	 */
+	RdtTimer *Expire(uint64_t now);
+
+	/**
+	 * @brief RdtNow() time at which Expire() may next return a timer
+	 * @return 0 if no timers are scheduled
+	 */
+	uint64_t NextDeadline() const;
+
+private:
+	enum
+	{
+		LEVELS = 4,
+		SLOT_BITS = 6,
+		SLOTS = 1 << SLOT_BITS,
+		SLOT_MASK = SLOTS - 1,
+		LEVEL_EXPIRED = LEVELS // Pseudo-level of timers waiting in m_pExpired
+	};
+
+	void Place(RdtTimer *pTimer);
+	void Link(RdtTimer *pTimer, int level, int slot);
+	RdtTimer *Detach(int level, int slot);
+	bool NextTick(uint64_t *pTick) const;
+	void Advance(uint64_t now);
+	RdtTimer **Head(int level, int slot);
+
+	static uint64_t ExpiryTick(const RdtTimer *pTimer);
+
+private:
+	uint64_t m_Tick; // Next tick to be processed
+	RdtTimer *m_pSlots[LEVELS][SLOTS];
+	uint64_t m_Occupied[LEVELS]; // Bit per non-empty slot
+	RdtTimer *m_pExpired;
+	size_t m_Count; // Timers scheduled, including expired ones not yet taken
+};
+
+#endif //_RDT_TIMER_WHEEL_H_
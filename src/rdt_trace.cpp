@@ -0,0 +1,253 @@
+/* File: rdt_trace.cpp
+ * Description: Implementation of the RdtTrace class
+ */
+
+#include "rdt_trace.h"
+#include "rdt_event_loop.h"
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+namespace
+{
+
+/**
+ * @brief Single-producer, single-consumer ring of one thread's records
+ */
+struct TraceRing
+{
+	TraceRing() : m_Head(0), m_Tail(0), m_Lost(0), m_Reported(0),
+				  m_bOrphaned(false){}
+
+	RdtTraceRecord m_Records[RDT_TRACE_RING];
+	std::atomic<uint32_t> m_Head; // Advanced by the writer
+	std::atomic<uint32_t> m_Tail; // Advanced by the owning thread
+	std::atomic<uint32_t> m_Lost;
+	uint32_t m_Reported;          // m_Lost as of the last RTE_LOST record
+	std::atomic<bool> m_bOrphaned; // Owning thread has exited
+};
+
+/**
+ * @brief Hands a thread's ring over to the writer when the thread exits
+ */
+struct TraceRingHandle
+{
+	TraceRingHandle() : m_pRing(nullptr){}
+	~TraceRingHandle()
+	{
+		if(m_pRing){ m_pRing->m_bOrphaned.store(true, std::memory_order_release); }
+	}
+
+	TraceRing *m_pRing;
+};
+
+std::mutex s_Mutex; // Guards everything below
+std::vector<TraceRing*> s_Rings;
+FILE *s_pFile = nullptr;
+std::thread s_Writer;
+std::condition_variable s_Wake;
+bool s_bStop = false;
+
+thread_local TraceRingHandle t_Handle;
+
+void Drain()
+{
+	for(size_t i = 0; i < s_Rings.size();)
+	{
+		TraceRing *pRing = s_Rings[i];
+		bool bOrphaned = pRing->m_bOrphaned.load(std::memory_order_acquire);
+		uint32_t head = pRing->m_Head.load(std::memory_order_relaxed);
+		uint32_t tail = pRing->m_Tail.load(std::memory_order_acquire);
+
+		if(s_pFile)
+		{
+			// At most two runs, split where the ring wraps
+			while(head != tail)
+			{
+				uint32_t index = head & (RDT_TRACE_RING - 1);
+				uint32_t count = std::min(tail - head, (uint32_t)RDT_TRACE_RING - index);
+				fwrite(&pRing->m_Records[index], sizeof(RdtTraceRecord), count, s_pFile);
+				head += count;
+			}
+
+			uint32_t lost = pRing->m_Lost.load(std::memory_order_relaxed);
+			if(lost != pRing->m_Reported)
+			{
+				RdtTraceRecord rec = {};
+				rec.m_Time = RdtNow();
+				rec.m_Event = RTE_LOST;
+				rec.m_Value = lost - pRing->m_Reported;
+				fwrite(&rec, sizeof(rec), 1, s_pFile);
+				pRing->m_Reported = lost;
+			}
+		}
+
+		pRing->m_Head.store(tail, std::memory_order_release);
+
+		if(bOrphaned)
+		{
+			delete pRing;
+			s_Rings[i] = s_Rings.back();
+			s_Rings.pop_back();
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	if(s_pFile)
+	{
+		fflush(s_pFile);
+	}
+}
+
+void WriterMain()
+{
+	std::unique_lock<std::mutex> lock(s_Mutex);
+	while(!s_bStop)
+	{
+		s_Wake.wait_for(lock, std::chrono::milliseconds(RDT_TRACE_FLUSH_MS));
+		Drain();
+	}
+}
+
+/**
+ * @brief Stops the writer at exit if the application never closed the trace
+ */
+struct TraceCloser
+{
+	~TraceCloser(){ RdtTrace::Close(); }
+} s_Closer;
+
+} // namespace
+
+std::atomic<int> RdtTrace::s_Level(RTL_OFF);
+
+int RdtTrace::Open(const char *path, ERdtTraceLevel level)
+{
+	Close();
+
+	FILE *pFile = fopen(path, "wb");
+	if(!pFile)
+	{
+		return -1;
+	}
+
+	RdtTraceFileHeader header = {};
+	memcpy(header.m_Magic, RDT_TRACE_MAGIC, sizeof(header.m_Magic));
+	header.m_Version = RDT_TRACE_VERSION;
+	header.m_RecordSize = sizeof(RdtTraceRecord);
+	fwrite(&header, sizeof(header), 1, pFile);
+
+	{
+		std::lock_guard<std::mutex> lock(s_Mutex);
+
+		// Anything recorded while closed is stale
+		s_pFile = nullptr;
+		Drain();
+
+		s_pFile = pFile;
+		s_bStop = false;
+	}
+
+	s_Writer = std::thread(WriterMain);
+	SetLevel(level);
+	return 0;
+}
+
+void RdtTrace::Close()
+{
+	SetLevel(RTL_OFF);
+
+	if(s_Writer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(s_Mutex);
+			s_bStop = true;
+		}
+		s_Wake.notify_one();
+		s_Writer.join();
+	}
+
+	std::lock_guard<std::mutex> lock(s_Mutex);
+	Drain();
+	if(s_pFile)
+	{
+		fclose(s_pFile);
+		s_pFile = nullptr;
+	}
+}
+
+void RdtTrace::SetLevel(ERdtTraceLevel level)
+{
+	s_Level.store(level, std::memory_order_relaxed);
+}
+
+void RdtTrace::Record(uint8_t event, uint32_t connId, const RdtHeader &hdr,
+					  uint32_t value)
+{
+	RdtTraceRecord rec;
+	rec.m_Time = RdtNow();
+	rec.m_ConnId = connId;
+	rec.m_Seq = hdr.m_SeqNumber;
+	rec.m_Timestamp = hdr.m_Timestamp;
+	rec.m_Value = value;
+	rec.m_Len = (hdr.m_MsgLen > sizeof(RdtHeader)) ? hdr.m_MsgLen - sizeof(RdtHeader) : 0;
+	rec.m_Flags = hdr.m_Flags;
+	rec.m_Event = event;
+	memset(rec.m_Pad, 0, sizeof(rec.m_Pad));
+	Append(rec);
+}
+
+void RdtTrace::RecordConnect(uint32_t connId, const sockaddr &local,
+							 const sockaddr &peer)
+{
+	const sockaddr_in &localIn = reinterpret_cast<const sockaddr_in&>(local);
+	const sockaddr_in &peerIn = reinterpret_cast<const sockaddr_in&>(peer);
+
+	RdtTraceRecord rec = {};
+	rec.m_Time = RdtNow();
+	rec.m_ConnId = connId;
+	rec.m_Seq = peerIn.sin_addr.s_addr;
+	rec.m_Timestamp = localIn.sin_addr.s_addr;
+	rec.m_Value = (uint32_t)peerIn.sin_port << 16 | localIn.sin_port;
+	rec.m_Event = RTE_CONNECT;
+	Append(rec);
+}
+
+const char *RdtTrace::EventName(uint8_t event)
+{
+	static const char *names[RTE_COUNT] =
+	{
+		"CONNECT", "SEND", "RESEND", "RECV", "RECV_DUP", "DROP", "LOST"
+	};
+
+	return (event < RTE_COUNT) ? names[event] : "UNKNOWN";
+}
+
+void RdtTrace::Append(const RdtTraceRecord &rec)
+{
+	TraceRing *pRing = t_Handle.m_pRing;
+	if(!pRing)
+	{
+		// Only the first record of each thread takes the lock
+		pRing = new TraceRing;
+		std::lock_guard<std::mutex> lock(s_Mutex);
+		s_Rings.push_back(pRing);
+		t_Handle.m_pRing = pRing;
+	}
+
+	uint32_t tail = pRing->m_Tail.load(std::memory_order_relaxed);
+	if(tail - pRing->m_Head.load(std::memory_order_acquire) >= RDT_TRACE_RING)
+	{
+		pRing->m_Lost.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	pRing->m_Records[tail & (RDT_TRACE_RING - 1)] = rec;
+	pRing->m_Tail.store(tail + 1, std::memory_order_release);
+}
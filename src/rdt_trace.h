@@ -0,0 +1,133 @@
+// File: rdt_trace.h
+// Description: Header containing the binary event tracing used in place of
+//              per-packet console output.
+
+#ifndef _RDT_TRACE_H_
+#define _RDT_TRACE_H_
+
+#include <cstdint>
+#include <atomic>
+#include "rdt_structures.h"
+
+enum ERdtTraceLevel
+{
+	RTL_OFF,
+	RTL_EVENT,  // Connections being set up and packets being dropped
+	RTL_PACKET  // Every packet sent or received
+};
+
+// Events above this level are compiled out entirely
+#ifndef RDT_TRACE_LEVEL
+#define RDT_TRACE_LEVEL RTL_PACKET
+#endif
+
+#define RDT_TRACE_RING 4096 // Records buffered per thread, a power of two
+#define RDT_TRACE_FLUSH_MS 10 // How often the writer drains the rings
+#define RDT_TRACE_MAGIC "RDTTRACE"
+#define RDT_TRACE_VERSION 2
+
+/**
+ * @brief Records a packet event if level is compiled in and enabled
+ *
+ * When tracing is off this costs a single relaxed load and branch, and
+ * nothing at all for levels above RDT_TRACE_LEVEL.
+ */
+#define RDT_TRACE(level, event, connId, hdr, value)							\
+	do																		\
+	{																		\
+		if((level) <= RDT_TRACE_LEVEL && RdtTrace::IsEnabled(level))		\
+		{																	\
+			RdtTrace::Record((event), (connId), (hdr), (value));			\
+		}																	\
+	} while(0)
+
+enum ERdtTraceEvent
+{
+	RTE_CONNECT,   // m_Seq/m_Timestamp: peer/local IPv4 address,
+	               // m_Value: peer port << 16 | local port (network order)
+	RTE_SEND,      // m_Value: congestion window
+	RTE_RESEND,    // m_Value: congestion window
+	RTE_RECV,      // m_Value: 1 if the packet arrived CE-marked
+	RTE_RECV_DUP,  // A data packet that was already received
+	RTE_DROP,      // Received but discarded (unknown peer, outside window)
+	RTE_LOST,      // m_Value: records a full ring had to discard
+	RTE_COUNT
+};
+
+/**
+ * @brief Fixed-size binary trace record, as stored in trace files
+ *
+ * Files start with an RdtTraceFileHeader, followed by records in host byte
+ * order; records of one thread are in order, but threads are interleaved in
+ * chunks.
+ */
+struct RdtTraceRecord
+{
+	uint64_t m_Time;      // RdtNow() ns
+	uint32_t m_ConnId;    // 0 if not attributable to a connection
+	uint32_t m_Seq;
+	uint32_t m_Timestamp; // Header timestamp
+	uint32_t m_Value;     // Event-specific
+	uint16_t m_Len;       // Payload bytes after the RDT header
+	uint16_t m_Flags;
+	uint8_t m_Event;
+	uint8_t m_Pad[3];
+};
+
+struct RdtTraceFileHeader
+{
+	char m_Magic[8];
+	uint32_t m_Version;
+	uint32_t m_RecordSize;
+};
+
+/**
+ * @brief Process-wide tracer
+ *
+ * Each thread appends records to its own single-producer ring without
+ * locking or blocking, discarding them (and counting how many) if the ring
+ * is full. A writer thread started by Open() drains every ring into the
+ * trace file, which the rdt_trace_decode tool turns into text or a pcap.
+ */
+class RdtTrace
+{
+public:
+	/**
+	 * @brief Starts tracing events up to level into the file at path
+	 * @return 0 if successful, -1 if the file couldn't be created
+	 */
+	static int Open(const char *path, ERdtTraceLevel level);
+
+	/**
+	 * @brief Stops tracing and writes out every buffered record
+	 */
+	static void Close();
+
+	/**
+	 * @brief Changes the level of events recorded while tracing
+	 */
+	static void SetLevel(ERdtTraceLevel level);
+
+	static bool IsEnabled(int level)
+	{
+		return level <= s_Level.load(std::memory_order_relaxed);
+	}
+
+	static void Record(uint8_t event, uint32_t connId, const RdtHeader &hdr,
+					   uint32_t value);
+
+	/**
+	 * @brief Records which addresses a connection is between, for pcaps
+	 */
+	static void RecordConnect(uint32_t connId, const sockaddr &local,
+							  const sockaddr &peer);
+
+	static const char *EventName(uint8_t event);
+
+private:
+	static void Append(const RdtTraceRecord &rec);
+
+	static std::atomic<int> s_Level;
+};
+
+#endif //_RDT_TRACE_H_
@@ -0,0 +1,164 @@
+/* File: rdt_unacked_table.cpp
+ * Description: Implementation of the RdtUnackedTable class
+ */
+
+#include "rdt_unacked_table.h"
+#include <cstdlib>
+#include <new>
+
+RdtUnackedTable::RdtUnackedTable() :
+	m_Capacity(0), m_Mask(0), m_Head(0), m_Tail(0), m_pSeq(nullptr),
+	m_pLength(nullptr), m_pPacket(nullptr), m_pPayload(nullptr),
+	m_pSendTime(nullptr), m_pResent(nullptr), m_pTimers(nullptr)
+{
+}
+
+RdtUnackedTable::~RdtUnackedTable()
+{
+	Free();
+}
+
+void RdtUnackedTable::Initialize(uint32_t capacity)
+{
+	Free();
+
+	// calloc() leaves large arrays to be backed by zero pages on first touch,
+	// so only the slots a connection actually reaches cost memory
+	uint32_t slots = RdtPow2(capacity);
+	m_Capacity = capacity;
+	m_Mask = slots - 1;
+	m_Head = m_Tail = 0;
+	m_pSeq = static_cast<uint32_t*>(calloc(slots, sizeof(uint32_t)));
+	m_pLength = static_cast<uint16_t*>(calloc(slots, sizeof(uint16_t)));
+	m_pPacket = static_cast<RdtPacket**>(calloc(slots, sizeof(RdtPacket*)));
+	m_pPayload = static_cast<const char**>(calloc(slots, sizeof(const char*)));
+	m_pSendTime = static_cast<uint64_t*>(calloc(slots, sizeof(uint64_t)));
+	m_pResent = static_cast<uint8_t*>(calloc(slots, sizeof(uint8_t)));
+	m_pTimers = static_cast<RdtTimer*>(calloc(slots, sizeof(RdtTimer)));
+}
+
+void RdtUnackedTable::Free()
+{
+	free(m_pSeq);
+	free(m_pLength);
+	free(m_pPacket);
+	free(m_pPayload);
+	free(m_pSendTime);
+	free(m_pResent);
+	free(m_pTimers);
+	m_pSeq = nullptr;
+	m_pLength = nullptr;
+	m_pPacket = nullptr;
+	m_pPayload = nullptr;
+	m_pSendTime = nullptr;
+	m_pResent = nullptr;
+	m_pTimers = nullptr;
+	m_Capacity = 0;
+	m_Head = m_Tail = 0;
+}
+
+int RdtUnackedTable::Push(RdtPacket *pPkt, const char *pPayload, uint64_t now)
+{
+	if(IsFull())
+	{
+		return -1;
+	}
+
+	int slot = m_Tail++ & m_Mask;
+	m_pSeq[slot] = pPkt->hdr.m_SeqNumber;
+	m_pLength[slot] = pPkt->hdr.SeqSpace();
+	m_pPacket[slot] = pPkt;
+	m_pPayload[slot] = pPayload;
+	m_pSendTime[slot] = now;
+	m_pResent[slot] = 0;
+	new (&m_pTimers[slot]) RdtTimer;
+	return slot;
+}
+
+int RdtUnackedTable::Find(uint32_t seq) const
+{
+	uint32_t index = Position(seq);
+	if(index >= Size() || m_pSeq[(m_Head + index) & m_Mask] != seq)
+	{
+		return -1;
+	}
+
+	int slot = (m_Head + index) & m_Mask;
+	return m_pPacket[slot] ? slot : -1;
+}
+
+int RdtUnackedTable::LowerBound(uint32_t seq) const
+{
+	// ACKed packets keep their slots until those before them are ACKed too
+	for(uint32_t index = Position(seq); index < Size(); ++index)
+	{
+		int slot = (m_Head + index) & m_Mask;
+		if(m_pPacket[slot])
+		{
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+int RdtUnackedTable::Back() const
+{
+	for(uint32_t index = m_Tail; index != m_Head; --index)
+	{
+		int slot = (index - 1) & m_Mask;
+		if(m_pPacket[slot])
+		{
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+uint32_t RdtUnackedTable::Position(uint32_t seq) const
+{
+	if(m_Head == m_Tail || SeqBefore(seq, m_pSeq[m_Head & m_Mask]))
+	{
+		return 0;
+	}
+
+	// Sequence numbers grow with the slot, so measure everything from the
+	// oldest packet
+	uint32_t first = m_pSeq[m_Head & m_Mask];
+	uint32_t dist = SeqDist(first, seq);
+	uint32_t count = m_Tail - m_Head;
+
+	uint32_t index = dist / RDT_SEGMENT;
+	if(index < count && m_pSeq[(m_Head + index) & m_Mask] == seq)
+	{
+		return index;
+	}
+
+	uint32_t lo = 0, hi = count;
+	while(lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(SeqDist(first, m_pSeq[(m_Head + mid) & m_Mask]) < dist)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+void RdtUnackedTable::Remove(int slot)
+{
+	m_pPacket[slot] = nullptr;
+
+	// Release the slots of the oldest packets once they are all ACKed
+	while(m_Head != m_Tail && m_pPacket[m_Head & m_Mask] == nullptr)
+	{
+		++m_Head;
+	}
+}
@@ -0,0 +1,117 @@
+// File: rdt_unacked_table.h
+// Description: Header containing the table that tracks the packets a
+//              connection has sent but not yet had ACKed.
+
+#ifndef _RDT_UNACKED_TABLE_H_
+#define _RDT_UNACKED_TABLE_H_
+
+#include <cstdint>
+#include "rdt_structures.h"
+#include "rdt_timer_wheel.h"
+
+/**
+ * @brief Sent packets awaiting an ACK, in the order they were first sent
+ *
+ * Packets occupy consecutive slots of a power-of-two ring, and each field
+ * lives in its own dense array, so ACK processing only touches the sequence
+ * numbers, lengths and packet pointers it needs. Since every data packet
+ * takes up a full segment of sequence space, a packet's slot is normally
+ * found straight from its distance past the oldest unacked packet; lookups
+ * only fall back to a binary search over the sequence numbers when a
+ * control packet sits in between.
+ *
+ * Each slot also holds the packet's retransmission timer, whose deadline is
+ * the packet's resend time. A packet's slot stays in use until it and every
+ * packet sent before it have been ACKed.
+ */
+class RdtUnackedTable
+{
+public:
+	RdtUnackedTable();
+	~RdtUnackedTable();
+
+	RdtUnackedTable(const RdtUnackedTable&) = delete;
+	RdtUnackedTable &operator=(const RdtUnackedTable&) = delete;
+
+	/**
+	 * @brief Allocates room for capacity packets, forgetting any held
+	 */
+	void Initialize(uint32_t capacity);
+
+	/**
+	 * @brief Stores a packet being sent for the first time
+	 * @param pPayload As for RdtConnection::Send()
+	 * @return Slot the packet was stored in, or -1 if the table is full
+	 */
+	int Push(RdtPacket *pPkt, const char *pPayload, uint64_t now);
+
+	/**
+	 * @brief Slot of the unacked packet with sequence number seq
+	 * @return -1 if no such packet is unacked
+	 */
+	int Find(uint32_t seq) const;
+
+	/**
+	 * @brief Slot of the first unacked packet whose sequence number is seq or
+	 *        comes after it
+	 * @return -1 if there is no such packet
+	 */
+	int LowerBound(uint32_t seq) const;
+
+	/**
+	 * @brief Forgets the packet in slot, which must be unacked
+	 * @note The timer must already be cancelled
+	 */
+	void Remove(int slot);
+
+	/**
+	 * @brief Slot of the oldest unacked packet, or -1 if there are none
+	 */
+	int Front() const{ return (m_Head == m_Tail) ? -1 : (int)(m_Head & m_Mask); }
+
+	/**
+	 * @brief Slot of the newest unacked packet, or -1 if there are none
+	 */
+	int Back() const;
+
+	/**
+	 * @brief Slots in use, including those of ACKed packets sent after the
+	 *        oldest unacked one
+	 */
+	uint32_t Size() const{ return m_Tail - m_Head; }
+	bool IsFull() const{ return Size() >= m_Capacity; }
+
+	uint32_t Seq(int slot) const{ return m_pSeq[slot]; }
+	uint16_t Length(int slot) const{ return m_pLength[slot]; }
+	RdtPacket *Packet(int slot) const{ return m_pPacket[slot]; }
+	const char *Payload(int slot) const{ return m_pPayload[slot]; }
+	uint64_t SendTime(int slot) const{ return m_pSendTime[slot]; }
+	bool IsResent(int slot) const{ return m_pResent[slot] != 0; }
+	void SetResent(int slot, uint64_t now){ m_pSendTime[slot] = now; m_pResent[slot] = 1; }
+	RdtTimer *Timer(int slot){ return &m_pTimers[slot]; }
+	int SlotOf(const RdtTimer *pTimer) const{ return (int)(pTimer - m_pTimers); }
+
+private:
+	void Free();
+
+	/**
+	 * @brief Number of slots past m_Head of the first packet at or after seq
+	 */
+	uint32_t Position(uint32_t seq) const;
+
+private:
+	uint32_t m_Capacity;
+	uint32_t m_Mask;
+	uint32_t m_Head; // Free-running; masked to index the arrays
+	uint32_t m_Tail;
+
+	uint32_t *m_pSeq;
+	uint16_t *m_pLength;      // Bytes of sequence space, including the header
+	RdtPacket **m_pPacket;    // nullptr once ACKed
+	const char **m_pPayload;  // Payload referenced in place, if any
+	uint64_t *m_pSendTime;    // Latest transmission, CLOCK_MONOTONIC ns
+	uint8_t *m_pResent;       // Whether sent more than once
+	RdtTimer *m_pTimers;
+};
+
+#endif //_RDT_UNACKED_TABLE_H_
@@ -0,0 +1,556 @@
+/* File: rdt_uring.cpp
+ * Description: Implementation of the RdtUring class over the raw io_uring
+ *              system calls
+ */
+
+#include "rdt.h"
+#include <unistd.h>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+RdtUring::RdtUring() :
+	m_RingFd(-1), m_EventFd(-1), m_Socket(-1), m_pRing(MAP_FAILED), m_RingSize(0),
+	m_pSqes(static_cast<io_uring_sqe*>(MAP_FAILED)), m_SqesSize(0),
+	m_pSqHead(nullptr), m_pSqTail(nullptr), m_pSqFlags(nullptr), m_SqMask(0),
+	m_pCqHead(nullptr), m_pCqTail(nullptr), m_pCqFlags(nullptr), m_CqMask(0),
+	m_pCqes(nullptr), m_SqEntries(0), m_SqTail(0),
+	m_pBufRing(static_cast<io_uring_buf_ring*>(MAP_FAILED)), m_BufRingSize(0),
+	m_pBuffers(static_cast<char*>(MAP_FAILED)), m_BufSize(0), m_PayloadSize(0),
+	m_BufCount(0), m_BufTail(0), m_bRecvArmed(false), m_SendsLeft(0)
+{
+	memset(&m_RecvHdr, 0, sizeof(m_RecvHdr));
+}
+
+RdtUring::~RdtUring()
+{
+	Shutdown();
+}
+
+int RdtUring::Initialize(int sock, size_t payloadSize, unsigned bufCount)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if(IsActive())
+	{
+		return 0;
+	}
+
+	// Leave room in the completion queue for every receive buffer to be
+	// filled while a batch of sends completes
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = 2 * (RdtPow2(bufCount) + RDT_URING_ENTRIES);
+	m_RingFd = (int)syscall(__NR_io_uring_setup, RDT_URING_ENTRIES, &params);
+	if(m_RingFd == -1)
+	{
+		return -1;
+	}
+
+	const unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+		IORING_FEAT_SUBMIT_STABLE;
+	if((params.features & features) != features)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	m_RingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+						  params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	m_pRing = mmap(nullptr, m_RingSize, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, m_RingFd, IORING_OFF_SQ_RING);
+	m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_pSqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_SqesSize, PROT_READ | PROT_WRITE,
+											  MAP_SHARED | MAP_POPULATE, m_RingFd,
+											  IORING_OFF_SQES));
+	if(m_pRing == MAP_FAILED || m_pSqes == MAP_FAILED)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	char *pRing = static_cast<char*>(m_pRing);
+	m_pSqHead = reinterpret_cast<unsigned*>(pRing + params.sq_off.head);
+	m_pSqTail = reinterpret_cast<unsigned*>(pRing + params.sq_off.tail);
+	m_pSqFlags = reinterpret_cast<unsigned*>(pRing + params.sq_off.flags);
+	m_SqMask = *reinterpret_cast<unsigned*>(pRing + params.sq_off.ring_mask);
+	m_SqEntries = params.sq_entries;
+	m_SqTail = *m_pSqTail;
+	m_pCqHead = reinterpret_cast<unsigned*>(pRing + params.cq_off.head);
+	m_pCqTail = reinterpret_cast<unsigned*>(pRing + params.cq_off.tail);
+	m_pCqFlags = reinterpret_cast<unsigned*>(pRing + params.cq_off.flags);
+	m_CqMask = *reinterpret_cast<unsigned*>(pRing + params.cq_off.ring_mask);
+	m_pCqes = reinterpret_cast<io_uring_cqe*>(pRing + params.cq_off.cqes);
+
+	// Entries are always submitted in order, so the indirection array can
+	// map every slot to itself once
+	unsigned *pArray = reinterpret_cast<unsigned*>(pRing + params.sq_off.array);
+	for(unsigned i = 0; i < m_SqEntries; ++i)
+	{
+		pArray[i] = i;
+	}
+
+	m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_EventFd == -1 ||
+	   syscall(__NR_io_uring_register, m_RingFd, IORING_REGISTER_EVENTFD, &m_EventFd, 1) == -1)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	// Every buffer has room for the recvmsg header, the sender's address and
+	// the control messages ahead of the payload
+	m_BufCount = RdtPow2(bufCount);
+	m_PayloadSize = payloadSize;
+	m_BufSize = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr) +
+		RdtIoBatch::CONTROL_SIZE + payloadSize;
+	m_BufRingSize = m_BufCount * sizeof(io_uring_buf);
+	m_pBufRing = static_cast<io_uring_buf_ring*>(mmap(nullptr, m_BufRingSize,
+													  PROT_READ | PROT_WRITE,
+													  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	m_pBuffers = static_cast<char*>(mmap(nullptr, m_BufCount * m_BufSize,
+										 PROT_READ | PROT_WRITE,
+										 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if(m_pBufRing == MAP_FAILED || m_pBuffers == MAP_FAILED)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uintptr_t>(m_pBufRing);
+	reg.ring_entries = m_BufCount;
+	reg.bgid = RDT_URING_BGID;
+	if(syscall(__NR_io_uring_register, m_RingFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	m_BufTail = 0;
+	for(unsigned i = 0; i < m_BufCount; ++i)
+	{
+		ProvideBuffer(i);
+	}
+
+	m_Received.Initialize(m_BufCount + RDT_URING_ENTRIES);
+	m_RecvHdr.msg_namelen = sizeof(sockaddr);
+	m_RecvHdr.msg_controllen = RdtIoBatch::CONTROL_SIZE;
+	m_Socket = sock;
+
+	// Kernels without multishot recvmsg fail it straight away
+	ArmRecv();
+	if(Enter(0) == -1)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	ReapCompletions();
+	if(!m_bRecvArmed)
+	{
+		FreeRing();
+		return -1;
+	}
+
+	return 0;
+}
+
+void RdtUring::Shutdown()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if(!IsActive())
+	{
+		return;
+	}
+
+	// Make sure the kernel is done with the receive buffers before they
+	// are unmapped
+	if(m_bRecvArmed)
+	{
+		io_uring_sqe *pSqe = GetSqe();
+		if(pSqe)
+		{
+			pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+			pSqe->fd = -1;
+			pSqe->addr = EOP_RECV;
+			pSqe->user_data = EOP_CANCEL;
+			while(m_bRecvArmed && Enter(1) == 0)
+			{
+				ReapCompletions();
+			}
+		}
+	}
+
+	FreeRing();
+}
+
+int RdtUring::Recv(RdtIoBatch &batch)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	// The datagrams handed out last time have been routed by now
+	for(uint16_t bid : m_Held)
+	{
+		ProvideBuffer(bid);
+	}
+	m_Held.clear();
+
+	ReapCompletions();
+
+	int count = 0;
+	Completion completion;
+	while(count < batch.m_Slots && m_Received.Pop(&completion))
+	{
+		if(!(completion.m_Flags & IORING_CQE_F_BUFFER))
+		{
+			continue;
+		}
+
+		uint16_t bid = completion.m_Flags >> IORING_CQE_BUFFER_SHIFT;
+		m_Held.push_back(bid);
+
+		// The buffer holds the header, then the name and control data in
+		// the space m_RecvHdr gave them, then the payload
+		char *pBuf = Buffer(bid);
+		size_t offset = sizeof(io_uring_recvmsg_out) + m_RecvHdr.msg_namelen +
+			m_RecvHdr.msg_controllen;
+		if(completion.m_Result < (int)offset)
+		{
+			continue;
+		}
+
+		const io_uring_recvmsg_out *pOut = reinterpret_cast<io_uring_recvmsg_out*>(pBuf);
+		char *pName = pBuf + sizeof(io_uring_recvmsg_out);
+		char *pControl = pName + m_RecvHdr.msg_namelen;
+		memcpy(&batch.m_pAddrs[count], pName,
+			   std::min((size_t)pOut->namelen, sizeof(sockaddr)));
+
+		msghdr &hdr = batch.m_pMsgs[count].msg_hdr;
+		hdr.msg_name = &batch.m_pAddrs[count];
+		hdr.msg_namelen = std::min((size_t)pOut->namelen, sizeof(sockaddr));
+		hdr.msg_control = pControl;
+		hdr.msg_controllen = std::min((size_t)pOut->controllen, (size_t)m_RecvHdr.msg_controllen);
+		hdr.msg_flags = pOut->flags;
+
+		// Truncated datagrams report their full length
+		size_t len = std::min((size_t)pOut->payloadlen, completion.m_Result - offset);
+		batch.Iov(count)[0].iov_base = pBuf + offset;
+		batch.Iov(count)[0].iov_len = len;
+		batch.m_pMsgs[count].msg_len = len;
+		++count;
+	}
+
+	// The multishot recvmsg ends whenever the kernel runs out of buffers
+	if(!m_bRecvArmed)
+	{
+		ArmRecv();
+		Enter(0);
+		SignalPending();
+	}
+
+	return count;
+}
+
+int RdtUring::SendMsgs(int sock, mmsghdr *pMsgs, int count)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	// Link the sends so that they go out in order and a failure cancels
+	// the rest, as sendmmsg() would stop at it
+	count = std::min(count, (int)m_SqEntries);
+	m_SendResults.assign(count, 0);
+	m_SendsLeft = 0;
+	io_uring_sqe *pLast = nullptr;
+	for(int i = 0; i < count; ++i)
+	{
+		io_uring_sqe *pSqe = GetSqe();
+		if(!pSqe)
+		{
+			break;
+		}
+
+		pSqe->opcode = IORING_OP_SENDMSG;
+		pSqe->fd = sock;
+		pSqe->addr = reinterpret_cast<uintptr_t>(&pMsgs[i].msg_hdr);
+		pSqe->len = 1;
+		pSqe->flags = (i + 1 < count) ? IOSQE_IO_LINK : 0;
+		pSqe->user_data = EOP_SEND | ((uint64_t)i << 2);
+		++m_SendsLeft;
+		pLast = pSqe;
+	}
+
+	// If the ring filled up, the chain ends early and mustn't take in
+	// whatever is queued after it
+	if(pLast)
+	{
+		pLast->flags &= ~IOSQE_IO_LINK;
+	}
+
+	count = m_SendsLeft;
+	while(m_SendsLeft > 0)
+	{
+		if(Enter(m_SendsLeft) == -1 && errno != EBUSY && errno != EAGAIN)
+		{
+			return -1;
+		}
+
+		ReapCompletions();
+	}
+
+	SignalPending();
+
+	for(int i = 0; i < count; ++i)
+	{
+		if(m_SendResults[i] < 0)
+		{
+			if(i == 0)
+			{
+				errno = -m_SendResults[i];
+				return -1;
+			}
+			return i;
+		}
+
+		pMsgs[i].msg_len = m_SendResults[i];
+	}
+
+	return count;
+}
+
+int RdtUring::Write(RdtUringWrite *pWrite, int fd, const iovec *pIov, int count)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	io_uring_sqe *pSqe = GetSqe();
+	if(!pSqe)
+	{
+		errno = EBUSY;
+		return -1;
+	}
+
+	pSqe->opcode = IORING_OP_WRITEV;
+	pSqe->fd = fd;
+	pSqe->off = (uint64_t)-1;
+	pSqe->addr = reinterpret_cast<uintptr_t>(pIov);
+	pSqe->len = count;
+	pSqe->user_data = reinterpret_cast<uintptr_t>(pWrite) | EOP_WRITE;
+
+	pWrite->m_Owner = std::this_thread::get_id();
+	pWrite->m_Length = 0;
+	for(int i = 0; i < count; ++i)
+	{
+		pWrite->m_Length += pIov[i].iov_len;
+	}
+	pWrite->m_Result = 0;
+	pWrite->m_bPending = true;
+
+	// Writes to the page cache mostly complete during the submission
+	int result = Enter(0);
+	ReapCompletions();
+	SignalPending();
+	return result;
+}
+
+bool RdtUring::Reap(RdtUringWrite *pWrite, bool bWait)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	ReapCompletions();
+	while(bWait && pWrite->m_bPending && Enter(1) == 0)
+	{
+		ReapCompletions();
+	}
+
+	SignalPending();
+	return !pWrite->m_bPending;
+}
+
+io_uring_sqe *RdtUring::GetSqe()
+{
+	if(m_SqTail - __atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE) >= m_SqEntries)
+	{
+		return nullptr;
+	}
+
+	io_uring_sqe *pSqe = &m_pSqes[m_SqTail++ & m_SqMask];
+	memset(pSqe, 0, sizeof(*pSqe));
+	return pSqe;
+}
+
+int RdtUring::Enter(unsigned wait)
+{
+	// Whoever enters reaps the completions it waits for, so only those
+	// posted in the background need to wake an event loop
+	__atomic_store_n(m_pSqTail, m_SqTail, __ATOMIC_RELEASE);
+	__atomic_store_n(m_pCqFlags, *m_pCqFlags | IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELAXED);
+
+	int result;
+	do
+	{
+		unsigned submit = m_SqTail - __atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE);
+		result = (int)syscall(__NR_io_uring_enter, m_RingFd, submit, wait,
+							  wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+	} while(result == -1 && errno == EINTR);
+
+	__atomic_store_n(m_pCqFlags, *m_pCqFlags & ~IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELAXED);
+	return (result == -1) ? -1 : 0;
+}
+
+void RdtUring::ReapCompletions()
+{
+	unsigned head = *m_pCqHead;
+	while(1)
+	{
+		if(head == __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE))
+		{
+			// Completions that found the queue full are held back in the
+			// kernel until it is entered
+			if(!(__atomic_load_n(m_pSqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+			{
+				break;
+			}
+
+			__atomic_store_n(m_pCqHead, head, __ATOMIC_RELEASE);
+			if(syscall(__NR_io_uring_enter, m_RingFd, 0, 0, IORING_ENTER_GETEVENTS,
+					   nullptr, 0) == -1 && errno != EINTR)
+			{
+				break;
+			}
+			continue;
+		}
+
+		const io_uring_cqe &cqe = m_pCqes[head++ & m_CqMask];
+		switch(cqe.user_data & EOP_MASK)
+		{
+		case EOP_RECV:
+		{
+			if(!(cqe.flags & IORING_CQE_F_MORE))
+			{
+				m_bRecvArmed = false;
+			}
+
+			Completion completion = { cqe.res, cqe.flags };
+			if(!m_Received.Push(completion) && (cqe.flags & IORING_CQE_F_BUFFER))
+			{
+				ProvideBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+			break;
+		}
+		case EOP_SEND:
+		{
+			size_t index = cqe.user_data >> 2;
+			if(index < m_SendResults.size())
+			{
+				m_SendResults[index] = cqe.res;
+				--m_SendsLeft;
+			}
+			break;
+		}
+		case EOP_WRITE:
+		{
+			RdtUringWrite *pWrite = reinterpret_cast<RdtUringWrite*>(cqe.user_data & ~(uint64_t)EOP_MASK);
+			pWrite->m_Result = cqe.res;
+			pWrite->m_bPending = false;
+			if(pWrite->m_pLoop && pWrite->m_Owner != std::this_thread::get_id())
+			{
+				pWrite->m_pLoop->Notify();
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	__atomic_store_n(m_pCqHead, head, __ATOMIC_RELEASE);
+}
+
+void RdtUring::SignalPending()
+{
+	if(m_Received.Size() > 0 ||
+	   *m_pCqHead != __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE))
+	{
+		uint64_t value = 1;
+		if(write(m_EventFd, &value, sizeof(value))){}
+	}
+}
+
+void RdtUring::ArmRecv()
+{
+	io_uring_sqe *pSqe = GetSqe();
+	if(!pSqe)
+	{
+		return;
+	}
+
+	// Each datagram is received into a buffer the kernel picks from the
+	// group, laid out as m_RecvHdr describes
+	pSqe->opcode = IORING_OP_RECVMSG;
+	pSqe->fd = m_Socket;
+	pSqe->addr = reinterpret_cast<uintptr_t>(&m_RecvHdr);
+	pSqe->len = 1;
+	pSqe->ioprio = IORING_RECV_MULTISHOT;
+	pSqe->flags = IOSQE_BUFFER_SELECT;
+	pSqe->buf_group = RDT_URING_BGID;
+	pSqe->user_data = EOP_RECV;
+	m_bRecvArmed = true;
+}
+
+void RdtUring::ProvideBuffer(uint16_t bid)
+{
+	// The ring's tail overlays the first entry; its bufs member can't be
+	// used from C++, which gives the empty struct ahead of it a size
+	io_uring_buf &buf = reinterpret_cast<io_uring_buf*>(m_pBufRing)[m_BufTail & (m_BufCount - 1)];
+	buf.addr = reinterpret_cast<uintptr_t>(Buffer(bid));
+	buf.len = m_BufSize;
+	buf.bid = bid;
+	++m_BufTail;
+	__atomic_store_n(&m_pBufRing->tail, m_BufTail, __ATOMIC_RELEASE);
+}
+
+void RdtUring::FreeRing()
+{
+	// Closing the ring releases everything registered with it
+	if(m_RingFd != -1)
+	{
+		close(m_RingFd);
+		m_RingFd = -1;
+	}
+
+	if(m_EventFd != -1)
+	{
+		close(m_EventFd);
+		m_EventFd = -1;
+	}
+
+	if(m_pRing != MAP_FAILED)
+	{
+		munmap(m_pRing, m_RingSize);
+		m_pRing = MAP_FAILED;
+	}
+
+	if(m_pSqes != MAP_FAILED)
+	{
+		munmap(m_pSqes, m_SqesSize);
+		m_pSqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	}
+
+	if(m_pBufRing != MAP_FAILED)
+	{
+		munmap(m_pBufRing, m_BufRingSize);
+		m_pBufRing = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+	}
+
+	if(m_pBuffers != MAP_FAILED)
+	{
+		munmap(m_pBuffers, m_BufCount * m_BufSize);
+		m_pBuffers = static_cast<char*>(MAP_FAILED);
+	}
+
+	m_Held.clear();
+	m_Received.Shutdown();
+	m_bRecvArmed = false;
+	m_Socket = -1;
+}
@@ -0,0 +1,205 @@
+// File: rdt_uring.h
+// Description: Header containing the io_uring backend that the socket owner
+//              can move its datagram and file I/O onto.
+
+#ifndef _RDT_URING_H_
+#define _RDT_URING_H_
+
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "rdt_structures.h"
+
+#define RDT_URING_ENTRIES 64 // Submission queue entries, at least RDT_IO_BATCH
+#define RDT_URING_BUFFERS 256 // Provided receive buffers, a power of two
+#define RDT_URING_GRO_BUFFERS 32 // Provided buffers when sized for GRO aggregates
+#define RDT_URING_BGID 0 // Buffer group the receive buffers are provided in
+
+enum ERdtIoBackend
+{
+	EIB_SOCKETS, // recvmmsg/sendmmsg and writev system calls
+	EIB_URING    // One io_uring for the socket and file writes
+};
+
+class RdtEventLoop;
+
+/**
+ * @brief File write submitted to an RdtUring, completed in the background
+ */
+struct RdtUringWrite
+{
+	RdtEventLoop *m_pLoop;   // Woken if another thread reaps the completion
+	std::thread::id m_Owner; // Thread that submitted the write
+	size_t m_Length;         // Bytes submitted
+	int m_Result;            // Bytes written or -errno, once not pending
+	bool m_bPending;
+};
+
+/**
+ * @brief io_uring driven straight through its system calls
+ *
+ * A single multishot recvmsg keeps receiving datagrams on the socket into
+ * buffers the kernel picks from a provided buffer ring, so datagrams that
+ * arrive while the application is busy cost no system calls at all; each
+ * is handed out in place, and its buffer goes back to the kernel on the next
+ * Recv(). Sends are submitted as a linked chain of sendmsg operations, which
+ * like sendmmsg() stops at the first one that fails.
+ *
+ * Completions are signalled on EventFd(), which event loops watch in place
+ * of the socket. Whichever thread reaps a completion stashes it for the
+ * thread that is waiting on it, so a ring may be shared by the connections
+ * accepted on its socket.
+ */
+class RdtUring
+{
+public:
+	RdtUring();
+	~RdtUring();
+
+	RdtUring(const RdtUring&) = delete;
+	RdtUring &operator=(const RdtUring&) = delete;
+
+	/**
+	 * @brief Sets up the ring and starts receiving on sock
+	 * @param payloadSize Largest datagram (or GRO aggregate) to receive
+	 * @return 0 if successful, -1 if the kernel lacks any of the io_uring
+	 *         features used, in which case nothing is left set up
+	 */
+	int Initialize(int sock, size_t payloadSize, unsigned bufCount);
+
+	/**
+	 * @brief Cancels receiving and tears the ring down
+	 */
+	void Shutdown();
+
+	bool IsActive() const{ return m_RingFd != -1; }
+
+	/**
+	 * @brief Counter fd that becomes readable as completions arrive
+	 */
+	int EventFd() const{ return m_EventFd; }
+
+	/**
+	 * @brief Largest datagram the receive buffers hold
+	 */
+	size_t PayloadSize() const{ return m_PayloadSize; }
+
+	/**
+	 * @brief Fills batch with the datagrams received since the last call,
+	 *        whose buffers go back to the kernel
+	 *
+	 * Each message's name, control data and first iovec point into the
+	 * receive buffer, which stays valid until the next call.
+	 *
+	 * @return Number of datagrams, without blocking
+	 */
+	int Recv(RdtIoBatch &batch);
+
+	/**
+	 * @brief Sends count messages through the ring, waiting for all of them
+	 * @return As sendmmsg()
+	 */
+	int SendMsgs(int sock, mmsghdr *pMsgs, int count);
+
+	/**
+	 * @brief Starts writing the count buffers of pIov to fd at its file
+	 *        position, like writev()
+	 * @note The buffers must stay valid until pWrite is no longer pending,
+	 *       but pIov itself only for the call
+	 * @return 0 if submitted, -1 if failed
+	 */
+	int Write(RdtUringWrite *pWrite, int fd, const iovec *pIov, int count);
+
+	/**
+	 * @brief Collects any completions
+	 * @param bWait Block until pWrite has completed
+	 * @return Whether pWrite has completed
+	 */
+	bool Reap(RdtUringWrite *pWrite, bool bWait=false);
+
+private:
+	enum EOperation
+	{
+		EOP_RECV,
+		EOP_SEND,  // Index of the message in the upper bits
+		EOP_WRITE, // RdtUringWrite pointer in the upper bits
+		EOP_CANCEL,
+		EOP_MASK = 3
+	};
+
+	struct Completion
+	{
+		int32_t m_Result;
+		uint32_t m_Flags;
+	};
+
+	io_uring_sqe *GetSqe();
+
+	/**
+	 * @brief Submits the queued entries and waits for wait completions,
+	 *        leaving those posted meanwhile unsignalled
+	 * @return 0 if successful, -1 if failed
+	 */
+	int Enter(unsigned wait);
+
+	/**
+	 * @brief Moves every posted completion off the completion queue,
+	 *        keeping received datagrams for Recv()
+	 */
+	void ReapCompletions();
+
+	/**
+	 * @brief Wakes a loop if completions were reaped or posted while
+	 *        signalling was off, so that none are left unnoticed
+	 */
+	void SignalPending();
+
+	char *Buffer(uint16_t bid){ return m_pBuffers + (size_t)bid * m_BufSize; }
+	void ArmRecv();
+	void ProvideBuffer(uint16_t bid);
+	void FreeRing();
+
+private:
+	int m_RingFd;
+	int m_EventFd;
+	int m_Socket;
+
+	// Rings shared with the kernel
+	void *m_pRing;
+	size_t m_RingSize;
+	io_uring_sqe *m_pSqes;
+	size_t m_SqesSize;
+	unsigned *m_pSqHead;
+	unsigned *m_pSqTail;
+	unsigned *m_pSqFlags;
+	unsigned m_SqMask;
+	unsigned *m_pCqHead;
+	unsigned *m_pCqTail;
+	unsigned *m_pCqFlags;
+	unsigned m_CqMask;
+	io_uring_cqe *m_pCqes;
+	unsigned m_SqEntries;
+	unsigned m_SqTail; // Ours, handed to the kernel by Enter()
+
+	// Provided receive buffers
+	io_uring_buf_ring *m_pBufRing;
+	size_t m_BufRingSize;
+	char *m_pBuffers;
+	size_t m_BufSize;
+	size_t m_PayloadSize;
+	unsigned m_BufCount;
+	uint16_t m_BufTail;
+	std::vector<uint16_t> m_Held; // Buffers handed out by the last Recv()
+	msghdr m_RecvHdr;             // Sizes the name and control of each buffer
+	bool m_bRecvArmed;            // Whether the multishot recvmsg is still live
+
+	CircularBuffer<Completion> m_Received; // Reaped, not yet taken by Recv()
+	std::vector<int> m_SendResults;
+	int m_SendsLeft;
+	std::mutex m_Mutex; // Guards everything above
+};
+
+#endif //_RDT_URING_H_
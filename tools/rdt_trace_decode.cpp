@@ -0,0 +1,233 @@
+/* File: rdt_trace_decode.cpp
+ * Description: Turns a binary trace written by RdtTrace into readable text,
+ *              and optionally into a pcap file that packet analyzers can
+ *              open, with the RDT header of every traced packet carried in
+ *              a synthesized IPv4/UDP packet.
+ */
+
+#include "rdt_trace.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <netinet/ip.h>
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_LINKTYPE_RAW 101 // Packets start at the IPv4 header
+
+struct PcapFileHeader
+{
+	uint32_t m_Magic;
+	uint16_t m_VersionMajor;
+	uint16_t m_VersionMinor;
+	int32_t m_ThisZone;
+	uint32_t m_SigFigs;
+	uint32_t m_SnapLen;
+	uint32_t m_LinkType;
+};
+
+struct PcapRecordHeader
+{
+	uint32_t m_Sec;
+	uint32_t m_Usec;
+	uint32_t m_CapLen;
+	uint32_t m_OrigLen;
+};
+
+// Captured bytes of each packet; the payload isn't traced
+struct PcapPacket
+{
+	iphdr ip;
+	udphdr udp;
+	RdtHeader rdt;
+} __attribute__((packed));
+
+/**
+ * @brief Addresses a connection was set up between, in network order
+ */
+struct Endpoints
+{
+	uint32_t m_LocalAddr;
+	uint32_t m_PeerAddr;
+	uint16_t m_LocalPort;
+	uint16_t m_PeerPort;
+};
+
+void printHelp(char **argv);
+
+uint16_t checksum(const void *pData, size_t len)
+{
+	const uint16_t *pWords = static_cast<const uint16_t*>(pData);
+	uint32_t sum = 0;
+	for(size_t i = 0; i < len / 2; ++i)
+	{
+		sum += pWords[i];
+	}
+	while(sum >> 16)
+	{
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum;
+}
+
+void writePacket(FILE *pPcap, const RdtTraceRecord &rec, const Endpoints &ends)
+{
+	// Sent packets go from us to the peer, everything else the other way
+	bool bOutgoing = rec.m_Event == RTE_SEND || rec.m_Event == RTE_RESEND;
+	size_t rdtLen = sizeof(RdtHeader) + rec.m_Len;
+
+	PcapPacket pkt;
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.ip.version = 4;
+	pkt.ip.ihl = sizeof(iphdr) / 4;
+	pkt.ip.tot_len = htons(sizeof(iphdr) + sizeof(udphdr) + rdtLen);
+	pkt.ip.ttl = 64;
+	pkt.ip.protocol = IPPROTO_UDP;
+	pkt.ip.saddr = bOutgoing ? ends.m_LocalAddr : ends.m_PeerAddr;
+	pkt.ip.daddr = bOutgoing ? ends.m_PeerAddr : ends.m_LocalAddr;
+	pkt.ip.check = checksum(&pkt.ip, sizeof(iphdr));
+
+	pkt.udp.source = bOutgoing ? ends.m_LocalPort : ends.m_PeerPort;
+	pkt.udp.dest = bOutgoing ? ends.m_PeerPort : ends.m_LocalPort;
+	pkt.udp.len = htons(sizeof(udphdr) + rdtLen);
+
+	pkt.rdt.m_SeqNumber = htonl(rec.m_Seq);
+	pkt.rdt.m_Timestamp = htonl(rec.m_Timestamp);
+	pkt.rdt.m_MsgLen = htons(rdtLen);
+	pkt.rdt.m_Flags = htons(rec.m_Flags);
+
+	PcapRecordHeader header;
+	header.m_Sec = rec.m_Time / 1000000000;
+	header.m_Usec = (rec.m_Time % 1000000000) / 1000;
+	header.m_CapLen = sizeof(pkt);
+	header.m_OrigLen = sizeof(iphdr) + sizeof(udphdr) + rdtLen;
+	fwrite(&header, sizeof(header), 1, pPcap);
+	fwrite(&pkt, sizeof(pkt), 1, pPcap);
+}
+
+int main(int argc, char **argv)
+{
+	const char *pTracePath = nullptr;
+	const char *pPcapPath = nullptr;
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+		{
+			pPcapPath = argv[++i];
+		}
+		else if(!pTracePath)
+		{
+			pTracePath = argv[i];
+		}
+		else
+		{
+			printHelp(argv);
+			return -1;
+		}
+	}
+
+	if(!pTracePath)
+	{
+		printHelp(argv);
+		return -1;
+	}
+
+	FILE *pTrace = fopen(pTracePath, "rb");
+	if(!pTrace)
+	{
+		fprintf(stderr, "Couldn't open %s\n", pTracePath);
+		return -1;
+	}
+
+	RdtTraceFileHeader header;
+	if(fread(&header, sizeof(header), 1, pTrace) != 1 ||
+	   memcmp(header.m_Magic, RDT_TRACE_MAGIC, sizeof(header.m_Magic)) != 0 ||
+	   header.m_Version != RDT_TRACE_VERSION ||
+	   header.m_RecordSize != sizeof(RdtTraceRecord))
+	{
+		fprintf(stderr, "%s is not a supported RDT trace\n", pTracePath);
+		fclose(pTrace);
+		return -1;
+	}
+
+	FILE *pPcap = nullptr;
+	if(pPcapPath)
+	{
+		pPcap = fopen(pPcapPath, "wb");
+		if(!pPcap)
+		{
+			fprintf(stderr, "Couldn't create %s\n", pPcapPath);
+			fclose(pTrace);
+			return -1;
+		}
+
+		PcapFileHeader pcapHeader = {PCAP_MAGIC, 2, 4, 0, 0, 65535, PCAP_LINKTYPE_RAW};
+		fwrite(&pcapHeader, sizeof(pcapHeader), 1, pPcap);
+	}
+
+	// A connection's first packets are traced before its addresses are, so
+	// collect those up front
+	std::map<uint32_t, Endpoints> connections;
+	RdtTraceRecord rec;
+	long firstRecord = ftell(pTrace);
+	while(fread(&rec, sizeof(rec), 1, pTrace) == 1)
+	{
+		if(rec.m_Event == RTE_CONNECT)
+		{
+			Endpoints &ends = connections[rec.m_ConnId];
+			ends.m_PeerAddr = rec.m_Seq;
+			ends.m_LocalAddr = rec.m_Timestamp;
+			ends.m_PeerPort = rec.m_Value >> 16;
+			ends.m_LocalPort = rec.m_Value & 0xffff;
+		}
+	}
+
+	fseek(pTrace, firstRecord, SEEK_SET);
+	while(fread(&rec, sizeof(rec), 1, pTrace) == 1)
+	{
+		printf("%llu.%09llu conn %u %-8s ",
+			   (unsigned long long)(rec.m_Time / 1000000000),
+			   (unsigned long long)(rec.m_Time % 1000000000),
+			   rec.m_ConnId, RdtTrace::EventName(rec.m_Event));
+
+		if(rec.m_Event == RTE_CONNECT)
+		{
+			const Endpoints &ends = connections[rec.m_ConnId];
+			char local[INET_ADDRSTRLEN], peer[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &ends.m_LocalAddr, local, sizeof(local));
+			inet_ntop(AF_INET, &ends.m_PeerAddr, peer, sizeof(peer));
+			printf("%s:%u -> %s:%u\n", local, ntohs(ends.m_LocalPort),
+				   peer, ntohs(ends.m_PeerPort));
+			continue;
+		}
+
+		if(rec.m_Event == RTE_LOST)
+		{
+			printf("%u records\n", rec.m_Value);
+			continue;
+		}
+
+		printf("seq %u ts %u len %u flags 0x%x value %u\n", rec.m_Seq,
+			   rec.m_Timestamp, rec.m_Len, rec.m_Flags, rec.m_Value);
+
+		// Drops may come from peers no connection exists for
+		std::map<uint32_t, Endpoints>::const_iterator it = connections.find(rec.m_ConnId);
+		if(pPcap && it != connections.end())
+		{
+			writePacket(pPcap, rec, it->second);
+		}
+	}
+
+	fclose(pTrace);
+	if(pPcap)
+	{
+		fclose(pPcap);
+	}
+
+	return 0;
+}
+
+void printHelp(char **argv)
+{
+	printf("usage: %s traceFile [-p pcapFile]\n\n", argv[0]);
+	printf("Prints the records of an RDT trace, and with -p also writes the traced packets' headers to a pcap file.\n");
+}